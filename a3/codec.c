@@ -0,0 +1,231 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+#include "codec.h"
+
+/*
+ * "none": a straight copy.
+ */
+static uint32_t none_bound(uint32_t len) {
+    return len;
+}
+
+static int32_t none_copy(const char *src, uint32_t len, char *dst, uint32_t cap) {
+    if (len > cap) {
+        return -1;
+    }
+    memcpy(dst, src, len);
+    return len;
+}
+
+/*
+ * "lz": a byte-oriented LZ77 codec using the LZ4 block layout.
+ *
+ * A block is a series of sequences.  Each sequence is a token byte (high
+ * nibble: literal count, low nibble: match length - 4, 15 meaning "more
+ * length bytes follow"), the literals, and a 2-byte little-endian offset
+ * back to the match.  The final sequence carries literals only.  Matches
+ * are found through a small hash table of 4-byte prefixes, which is cheap
+ * enough to run on every batch of map output.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5   // The last bytes of a block are always literals.
+#define LZ_MATCH_LIMIT 12    // No match may start this close to the end.
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint32_t lz_bound(uint32_t len) {
+    return len + len / 255 + 16;
+}
+
+/*
+ * Write a length extension (the part of a count at or above 15) at *op.
+ * Return 0 on success, -1 if it does not fit.
+ */
+static int lz_put_length(char *dst, uint32_t *op, uint32_t cap, uint32_t len) {
+    while (len >= 255) {
+        if (*op >= cap) {
+            return -1;
+        }
+        dst[(*op)++] = (char) 255;
+        len -= 255;
+    }
+    if (*op >= cap) {
+        return -1;
+    }
+    dst[(*op)++] = (char) len;
+    return 0;
+}
+
+/*
+ * Emit one sequence: literals src[anchor..anchor+nlit) followed by a match
+ * of match_len bytes at offset (no match if match_len is 0).
+ */
+static int lz_put_sequence(const char *src, uint32_t anchor, uint32_t nlit,
+                           uint32_t offset, uint32_t match_len,
+                           char *dst, uint32_t *op, uint32_t cap) {
+    uint32_t lit_code = nlit < 15 ? nlit : 15;
+    uint32_t match_code = 0;
+    if (match_len > 0) {
+        match_code = match_len - LZ_MIN_MATCH < 15 ? match_len - LZ_MIN_MATCH : 15;
+    }
+
+    if (*op >= cap) {
+        return -1;
+    }
+    dst[(*op)++] = (char) ((lit_code << 4) | match_code);
+    if (lit_code == 15 && lz_put_length(dst, op, cap, nlit - 15) == -1) {
+        return -1;
+    }
+    if (cap - *op < nlit) {
+        return -1;
+    }
+    memcpy(dst + *op, src + anchor, nlit);
+    *op += nlit;
+
+    if (match_len == 0) {
+        return 0;
+    }
+    if (cap - *op < 2) {
+        return -1;
+    }
+    dst[(*op)++] = (char) (offset & 0xff);
+    dst[(*op)++] = (char) (offset >> 8);
+    if (match_code == 15 &&
+        lz_put_length(dst, op, cap, match_len - LZ_MIN_MATCH - 15) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int32_t lz_compress(const char *src, uint32_t len, char *dst, uint32_t cap) {
+    int32_t table[1 << LZ_HASH_BITS];
+    uint32_t ip = 0, anchor = 0, op = 0;
+
+    memset(table, -1, sizeof(table));
+    while (len > LZ_MATCH_LIMIT && ip < len - LZ_MATCH_LIMIT) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = lz_hash(seq);
+        int32_t ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        uint32_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < len - LZ_LAST_LITERALS &&
+               src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+        if (lz_put_sequence(src, anchor, ip - anchor, ip - ref, match_len,
+                            dst, &op, cap) == -1) {
+            return -1;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (lz_put_sequence(src, anchor, len - anchor, 0, 0, dst, &op, cap) == -1) {
+        return -1;
+    }
+    return op;
+}
+
+/*
+ * Read a length extension starting at *ip and add it to *len.
+ */
+static int lz_get_length(const char *src, uint32_t *ip, uint32_t n, uint32_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= n) {
+            return -1;
+        }
+        b = (unsigned char) src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+static int32_t lz_decompress(const char *src, uint32_t len, char *dst, uint32_t cap) {
+    uint32_t ip = 0, op = 0;
+
+    while (ip < len) {
+        unsigned char token = (unsigned char) src[ip++];
+        uint32_t nlit = token >> 4;
+        if (nlit == 15 && lz_get_length(src, &ip, len, &nlit) == -1) {
+            return -1;
+        }
+        if (len - ip < nlit || cap - op < nlit) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == len) {   // Last sequence has no match.
+            break;
+        }
+        if (len - ip < 2) {
+            return -1;
+        }
+        uint32_t offset = (unsigned char) src[ip] | ((unsigned char) src[ip + 1] << 8);
+        ip += 2;
+        uint32_t match_len = token & 15;
+        if (match_len == 15 && lz_get_length(src, &ip, len, &match_len) == -1) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || cap - op < match_len) {
+            return -1;
+        }
+        // Byte at a time: the match may overlap the bytes it produces.
+        for (uint32_t i = 0; i < match_len; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op;
+}
+
+static const Codec codecs[] = {
+    {"none", CODEC_NONE, none_bound, none_copy, none_copy},
+    {"lz", 1, lz_bound, lz_compress, lz_decompress},
+};
+
+#define NUM_CODECS (sizeof(codecs) / sizeof(codecs[0]))
+
+const Codec *find_codec(const char *name) {
+    for (unsigned i = 0; i < NUM_CODECS; i++) {
+        if (strcmp(codecs[i].name, name) == 0) {
+            return &codecs[i];
+        }
+    }
+    return NULL;
+}
+
+const Codec *find_codec_id(uint8_t id) {
+    for (unsigned i = 0; i < NUM_CODECS; i++) {
+        if (codecs[i].id == id) {
+            return &codecs[i];
+        }
+    }
+    return NULL;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
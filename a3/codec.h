@@ -0,0 +1,48 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdint.h>
+
+/*
+ * Block compression codecs for intermediate (shuffle) data.
+ *
+ * A codec turns one block of len bytes into at most bound(len) bytes and
+ * back.  Blocks are self-contained, so each batched frame can be
+ * compressed and decompressed on its own.
+ */
+typedef struct codec {
+    const char *name;
+    uint8_t id;     // Sent on the wire to identify the codec.
+
+    // Worst-case compressed size of a len-byte block.
+    uint32_t (*bound)(uint32_t len);
+
+    // Compress/decompress len bytes of src into dst, which has room for cap
+    // bytes.  Return the number of bytes written, or -1 if dst is too
+    // small or (when decompressing) src is corrupt.
+    int32_t (*compress)(const char *src, uint32_t len, char *dst, uint32_t cap);
+    int32_t (*decompress)(const char *src, uint32_t len, char *dst, uint32_t cap);
+} Codec;
+
+// Totals kept by whoever runs a codec, for the end-of-job report.
+typedef struct codec_stats {
+    uint64_t raw_bytes;      // bytes before compression
+    uint64_t packed_bytes;   // bytes actually sent
+    uint64_t compress_ns;    // time spent compressing
+    uint64_t decompress_ns;  // time spent decompressing
+} CodecStats;
+
+#define CODEC_NONE 0   // id of the "none" codec: frames are sent as-is
+
+/*
+ * Return the codec with the given name or id, or NULL if there is none.
+ */
+const Codec *find_codec(const char *name);
+const Codec *find_codec_id(uint8_t id);
+
+/*
+ * Return a monotonic timestamp in nanoseconds, for timing codec work.
+ */
+uint64_t now_ns(void);
+
+#endif
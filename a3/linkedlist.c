@@ -1,19 +1,24 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "linkedlist.h"
 
 /*
- * Return a pointer to a newly created LLKeyValues node.
- * Note it starts off with just a single value in its LLValues list.
+ * Return a pointer to a newly created LLKeyValues node for key.
+ * Note it starts off with no values.
  */
-LLKeyValues *create_node(Pair pair) {
+LLKeyValues *create_node(const char *key) {
     LLKeyValues *new_node = malloc(sizeof(LLKeyValues));
-    strncpy(new_node->key, pair.key, MAX_KEY - 1);
+    if (new_node == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    strncpy(new_node->key, key, MAX_KEY - 1);
     new_node->key[MAX_KEY - 1] = '\0';
-    new_node->head_value = malloc(sizeof(LLValues));
-    strncpy(new_node->head_value->value, pair.value, MAX_VALUE - 1);
-    new_node->head_value->value[MAX_VALUE - 1] = '\0';
-    new_node->head_value->next = NULL;
+    new_node->head_value = NULL;
+    new_node->ints = NULL;
+    new_node->nints = 0;
+    new_node->cap_ints = 0;
     new_node->next = NULL;
 
     return new_node;
@@ -31,36 +36,170 @@ void insert_value(LLKeyValues *list, const char *value) {
 }
 
 /*
- * Insert into the list of keys and values pointed to by head_ptr.
- * Ensures that all values corresponding to a single key are grouped together.
+ * Append a value to the end of a node's integer values.
  */
-void insert_into_keys(LLKeyValues **head_ptr, Pair pair) {
-    LLKeyValues *curr = *head_ptr;
+void insert_int(LLKeyValues *list, int64_t value) {
+    if (list->nints == list->cap_ints) {
+        list->cap_ints = list->cap_ints ? list->cap_ints * 2 : 4;
+        list->ints = realloc(list->ints, sizeof(int64_t) * list->cap_ints);
+        if (list->ints == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    list->ints[list->nints++] = value;
+}
+
+/*
+ * Hash index over the list currently being built, so that inserting a
+ * pair costs O(1) instead of a scan of every key seen so far.  New keys go
+ * on the front of the list; sort_key_values() puts them in order.
+ */
+static LLKeyValues **index_slots = NULL;
+static size_t index_size = 0;       // Number of slots, a power of two.
+static size_t index_used = 0;
+static LLKeyValues **index_list = NULL;   // head_ptr the index describes.
+
+static size_t hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+    while (*key != '\0') {
+        h ^= (unsigned char) *key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Return the slot where key is, or where it would go.
+ */
+static size_t index_find(const char *key) {
+    size_t slot = hash_key(key) & (index_size - 1);
+    while (index_slots[slot] != NULL && strcmp(index_slots[slot]->key, key) != 0) {
+        slot = (slot + 1) & (index_size - 1);
+    }
+    return slot;
+}
+
+/*
+ * Drop the index, e.g. once the list is complete.
+ */
+static void index_clear(void) {
+    free(index_slots);
+    index_slots = NULL;
+    index_size = index_used = 0;
+    index_list = NULL;
+}
+
+/*
+ * Resize the index to new_size slots and re-add every key in *head_ptr.
+ */
+static void index_rebuild(LLKeyValues **head_ptr, size_t new_size) {
+    free(index_slots);
+    index_slots = calloc(new_size, sizeof(LLKeyValues *));
+    if (index_slots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    index_size = new_size;
+    index_used = 0;
+    index_list = head_ptr;
+    for (LLKeyValues *curr = *head_ptr; curr != NULL; curr = curr->next) {
+        index_slots[index_find(curr->key)] = curr;
+        index_used++;
+    }
+}
+
+/*
+ * Return the node for key in the list pointed to by head_ptr, adding a
+ * new empty node at the front if the key is not there yet.
+ */
+LLKeyValues *find_or_insert_key(LLKeyValues **head_ptr, const char *key) {
+    if (index_list != head_ptr) {
+        index_rebuild(head_ptr, 1024);
+    }
 
-    // Check if we need to create a new list of Pairs at the head of the list
-    if (curr == NULL || strcmp(curr->key, pair.key) > 0) {
-        LLKeyValues *new_node = create_node(pair);
-        new_node->next = curr;
-        *head_ptr = new_node;
-    } else {
-        LLKeyValues *prev = NULL;
-        while (curr != NULL && strcmp(curr->key, pair.key) <= 0) {
-            prev = curr;
-            curr = curr->next;
+    size_t slot = index_find(key);
+    if (index_slots[slot] != NULL) { // Key already exists
+        return index_slots[slot];
+    }
+
+    LLKeyValues *new_node = create_node(key);
+    new_node->next = *head_ptr;
+    *head_ptr = new_node;
+    index_slots[slot] = new_node;
+    index_used++;
+    if (index_used * 4 > index_size * 3) { // Keep the load under 3/4
+        index_rebuild(head_ptr, index_size * 2);
+    }
+    return new_node;
+}
+
+/*
+ * Merge two lists that are each sorted by key.
+ */
+static LLKeyValues *merge_keys(LLKeyValues *a, LLKeyValues *b) {
+    LLKeyValues head;
+    LLKeyValues *tail = &head;
+    while (a != NULL && b != NULL) {
+        if (strcmp(a->key, b->key) <= 0) {
+            tail->next = a;
+            a = a->next;
+        } else {
+            tail->next = b;
+            b = b->next;
         }
+        tail = tail->next;
+    }
+    tail->next = (a != NULL) ? a : b;
+    return head.next;
+}
+
+/*
+ * Sort the list by key (merge sort) and drop its index.
+ */
+void sort_key_values(LLKeyValues **head_ptr) {
+    if (index_list == head_ptr) {
+        index_clear();
+    }
 
-        if (prev == NULL) { // insert at head of list
-            LLKeyValues *new_node = create_node(pair);
-            new_node->next = curr;
-            *head_ptr = new_node;
-        } else if (strcmp(prev->key, pair.key) == 0) { // Key already exists
-            insert_value(prev, pair.value);
-        } else { // Need to insert new key
-            LLKeyValues *new_node = create_node(pair);
-            new_node->next = curr;
-            prev->next = new_node;
+    // Bottom-up: keep sorted runs of 1, 2, 4, ... nodes in runs[i] and
+    // merge them like a binary counter.
+    LLKeyValues *runs[64] = {NULL};
+    LLKeyValues *curr = *head_ptr;
+    while (curr != NULL) {
+        LLKeyValues *next = curr->next;
+        curr->next = NULL;
+        int i;
+        for (i = 0; runs[i] != NULL; i++) {
+            curr = merge_keys(runs[i], curr);
+            runs[i] = NULL;
+        }
+        runs[i] = curr;
+        curr = next;
+    }
+
+    LLKeyValues *sorted = NULL;
+    for (int i = 0; i < 64; i++) {
+        if (runs[i] != NULL) {
+            sorted = merge_keys(runs[i], sorted);
         }
     }
+    *head_ptr = sorted;
+}
+
+/*
+ * Insert into the list of keys and values pointed to by head_ptr.
+ * Ensures that all values corresponding to a single key are grouped together.
+ */
+void insert_into_keys(LLKeyValues **head_ptr, Pair pair) {
+    insert_value(find_or_insert_key(head_ptr, pair.key), pair.value);
+}
+
+/*
+ * Integer version of insert_into_keys.
+ */
+void insert_int_into_keys(LLKeyValues **head_ptr, IntPair pair) {
+    insert_int(find_or_insert_key(head_ptr, pair.key), pair.value);
 }
 
 /*
@@ -80,9 +219,13 @@ void free_value_list(LLValues *head) {
  * Free all memory associated with the given list of keys and values.
  */
 void free_key_values_list(LLKeyValues *head) {
+    if (index_list != NULL && *index_list == head) {
+        index_clear();
+    }
     LLKeyValues *curr = head;
     while (curr != NULL) {
         free_value_list(curr->head_value);
+        free(curr->ints);
         LLKeyValues *next = curr->next;
         free(curr);
         curr = next;
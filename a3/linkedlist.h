@@ -6,9 +6,24 @@
 /*
  * Inserts into the list of keys and values pointed to by head_ptr.
  * Ensures that all values corresponding to a single key are grouped together.
+ *
+ * Keys are found through a hash index kept for the list being built, and
+ * new keys are added at the front: call sort_key_values() once every pair
+ * has been inserted.  Only one list can be built at a time.
  */
 void insert_into_keys(LLKeyValues **head_ptr, Pair pair);
 
+/*
+ * Integer version of insert_into_keys: appends pair.value to the ints
+ * array of its key.
+ */
+void insert_int_into_keys(LLKeyValues **head_ptr, IntPair pair);
+
+/*
+ * Sorts the list by key, and releases the index used while inserting.
+ */
+void sort_key_values(LLKeyValues **head_ptr);
+
 /*
  * Frees all memory associated with the given list of keys and values.
  */
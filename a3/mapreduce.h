@@ -1,6 +1,8 @@
 #ifndef MAPREDUCE_H
 #define MAPREDUCE_H
 
+#include <stdint.h>
+
 #define MAX_KEY 64       // Max size of key, including null-terminator.
 #define MAX_VALUE 256    // Max size of value, including null-terminator.
 #define MAX_FILENAME 32  // Max length of input file path, including null-terminator.
@@ -8,6 +10,9 @@
                          //   - You should allocate one more byte than this number
                          //     for a final null-terminator after these bytes.
 
+#define VALUE_STRING 0   // Values are strings: map() and reduce() are used.
+#define VALUE_INT64 1    // Values are integers: map_int() and reduce_int() are used.
+
 void map_worker(int outfd, int infd);
 void reduce_worker(int outfd, int infd);
 
@@ -18,6 +23,13 @@ typedef struct pair {
     char value[MAX_VALUE];
 } Pair;
 
+// A key and a native integer value, emitted by map_int().
+// key must be null-terminated.
+typedef struct int_pair {
+    char key[MAX_KEY];
+    int64_t value;
+} IntPair;
+
 // Linked list - each node contains a (string) value.
 // value must be null-terminated.
 typedef struct valuelist {
@@ -27,9 +39,13 @@ typedef struct valuelist {
 
 // Linked list - each node contains a unique key and list of corresponding values.
 // key must be null-terminated.
+// Integer jobs keep their values unboxed in the ints array instead.
 typedef struct keyValues {
     char key[MAX_KEY];
     LLValues *head_value;
+    int64_t *ints;
+    int nints;
+    int cap_ints;
     struct keyValues *next;
 } LLKeyValues;
 
@@ -38,6 +54,9 @@ typedef struct keyValues {
  * Takes a chunk of text and generates zero or more
  * Pair values, which it writes to outfd.
  *
+ * Chunks of one file are passed in order, followed by an empty chunk
+ * marking the end of the file, so a job may carry state between chunks.
+ *
  * Precondition: chunk is a null-terminated string.
  */
 void map(const char *chunk, int outfd);
@@ -51,4 +70,20 @@ void map(const char *chunk, int outfd);
 Pair reduce(const char *key, const LLValues *values);
 
 
+/*
+ * The type of values this job works with: VALUE_STRING or VALUE_INT64.
+ */
+extern const int job_value_type;
+
+/*
+ * Integer versions of map() and reduce(), used when job_value_type is
+ * VALUE_INT64.  map_int() writes IntPairs to outfd; reduce_int() gets
+ * every value for key in one contiguous array.
+ *
+ * Precondition: chunk and key are null-terminated.
+ */
+void map_int(const char *chunk, int outfd);
+int64_t reduce_int(const char *key, const int64_t *values, int nvalues);
+
+
 #endif
@@ -4,7 +4,6 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include "mapreduce.h"
-#include "word_freq.c"
 
 /*
  * Map worker process
@@ -24,12 +23,18 @@ void map_worker(int outfd, int infd) {
             exit(1);
         }
         
-        // Process one file
-        while (!feof(input_file)) {
-            fread(buffer, READSIZE, 1, input_file);
-            strncat(buffer, "\0", 1);
-            map(buffer, outfd); // Get (key, value) pairs and send to parent
-        }
+        // Process one file, then pass an empty chunk to mark its end
+        size_t nread;
+        do {
+            nread = fread(buffer, 1, READSIZE, input_file);
+            buffer[nread] = '\0';
+            // Get (key, value) pairs and send to parent
+            if (job_value_type == VALUE_INT64) {
+                map_int(buffer, outfd);
+            } else {
+                map(buffer, outfd);
+            }
+        } while (nread > 0);
         
         error = fclose(input_file);
         if (error != 0) {
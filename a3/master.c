@@ -8,7 +8,9 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 #include "mapreduce.h"
-#include "linkedlist.c"
+#include "linkedlist.h"
+#include "netproto.h"
+#include "outwriter.h"
  
 /*
  * Helper function 
@@ -17,7 +19,7 @@
  */
 void check_arg(int arg) {
     if (arg == 0) {
-        fprintf(stderr, "Usage: mapreduce -d dirname [-m numprocs] [-c numprocs]\n");
+        fprintf(stderr, "Usage: mapreduce -d dirname [-m numprocs] [-r numprocs] [-o bin|tsv] [-s none|end|flush] [-p port -w numworkers [-z codec]]\n");
         exit(1);
     }
 }
@@ -67,14 +69,20 @@ int main(int argc, char *argv[]) {
     int m_numprocs = 2;
     int r_numprocs = 2;
     int d_flag = 0;    // 1 when the user inputed a valid argument for d
+    int port = 0;      // Port to accept TCP workers on; 0 runs locally
+    int w_numworkers = 0;
+    const Codec *codec = NULL;  // Compression for shuffled data in distributed mode
+    int out_format = OUT_BINARY;
+    int fsync_policy = SYNC_NONE;
     int *all_map_pids = NULL;   // Array of pids for all map_workers
     int *all_re_pids = NULL;    // Array of pids for all map_workers
     Pair pair;
+    IntPair int_pair;
     LLKeyValues *key_values = NULL;
     
     // Use getopt to check and store arguments
     int opt = 0;
-    while ((opt = getopt(argc, argv, "r:m:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "r:m:d:p:w:z:o:s:")) != -1) {
         switch(opt) {
             case 'd':
                 strncpy(dirname, optarg, MAX_FILENAME);
@@ -88,13 +96,35 @@ int main(int argc, char *argv[]) {
                 r_numprocs = strtol(optarg, NULL, 10);
                 check_arg(r_numprocs);
                 break;
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                check_arg(port);
+                break;
+            case 'w':
+                w_numworkers = strtol(optarg, NULL, 10);
+                check_arg(w_numworkers);
+                break;
+            case 'z':
+                codec = find_codec(optarg);
+                check_arg(codec != NULL);
+                break;
+            case 'o':
+                out_format = parse_out_format(optarg);
+                check_arg(out_format != -1);
+                break;
+            case 's':
+                fsync_policy = parse_fsync_policy(optarg);
+                check_arg(fsync_policy != -1);
+                break;
             default:
-                fprintf(stderr, "Usage: mapreduce -d dirname [-m numprocs] [-c numprocs]\n");
+                fprintf(stderr, "Usage: mapreduce -d dirname [-m numprocs] [-r numprocs] [-o bin|tsv] [-s none|end|flush] [-p port -w numworkers [-z codec]]\n");
                 exit(1); 
         }
     }
     
     check_arg(d_flag);
+    check_arg(!port == !w_numworkers);  // -p and -w go together
+    set_output_options(out_format, fsync_policy);
 
     
     // Create a pipe for ls process
@@ -118,6 +148,23 @@ int main(int argc, char *argv[]) {
         close_check(ls_fd[0]); // Close the reading end 
 
         wait(NULL);    // Parent waits for ls process to finish executing
+
+        if (port != 0) { // Distributed mode: TCP workers do the map and reduce
+            char path[MAX_FILENAME];
+            snprintf(path, MAX_FILENAME, "./%d.out", getpid());
+            FILE *output_file = fopen(path, "wb");
+            if (!output_file) {
+                perror("fopen");
+                exit(1);
+            }
+            set_frame_codec(codec);
+            run_distributed(dirname, port, w_numworkers, fileno(output_file));
+            if (fclose(output_file) != 0) {
+                fprintf(stderr, "fclose failed\n");
+                exit(1);
+            }
+            return 0;
+        }
         
         // File descriptors for pipes to map_worker process
         int map_fp_fd[m_numprocs][2];   // from parent (send stuff to child)
@@ -162,11 +209,11 @@ int main(int argc, char *argv[]) {
                 while (scanf("%s", file_name) > 0) {
 					
                     // Create file path starting at current directory
-                    strncpy(path, "./", MAX_FILENAME); 
-                    strncpy(path, dirname, MAX_FILENAME);
-                    strncat(path, "/", 1);
-                    strncat(path, file_name, MAX_FILENAME);
-                    strncat(path, "\0", 1);
+                    if (snprintf(path, MAX_FILENAME, "%s/%s", dirname,
+                        file_name) >= MAX_FILENAME) {
+                        fprintf(stderr, "%s/%s: path too long\n", dirname, file_name);
+                        continue;
+                    }
         
                     // Write input file name to map_worker to the "from parent" pipe
                     if (write(map_fp_fd[m][1], path, MAX_FILENAME) == -1) {
@@ -186,8 +233,14 @@ int main(int argc, char *argv[]) {
                 close_check(map_fp_fd[i][1]);
                 
                 // Read pairs from mapworker child
-                while (read(map_tp_fd[i][0], &pair, sizeof(Pair)) > 0) {
-                    insert_into_keys(&key_values, pair);
+                if (job_value_type == VALUE_INT64) {
+                    while (read(map_tp_fd[i][0], &int_pair, sizeof(IntPair)) > 0) {
+                        insert_int_into_keys(&key_values, int_pair);
+                    }
+                } else {
+                    while (read(map_tp_fd[i][0], &pair, sizeof(Pair)) > 0) {
+                        insert_into_keys(&key_values, pair);
+                    }
                 }
                 
                 // Done reading pairs, close the reading end of all 
@@ -218,6 +271,7 @@ int main(int argc, char *argv[]) {
         // Parent waits for all map_worker process to finish executing
         wait_workers(all_map_pids, m_numprocs);
         free(all_map_pids);
+        sort_key_values(&key_values);
         
          // File descriptors for pipes to reduce_worker process
         int reduce_fp_fd[r_numprocs][2];   // from parent (send stuff to child)
@@ -238,37 +292,34 @@ int main(int argc, char *argv[]) {
 
                 close_check(reduce_fp_fd[j][0]); // Close read 
                 
-                if (j == 0) {
-                    int r = 0; // Identify each reduce_worker
-                    LLKeyValues *curr = key_values; 
-                    while (curr != NULL) {
-                        if (write(reduce_fp_fd[r][1], &curr, 
-                            sizeof(LLKeyValues *)) == -1) {
-                            perror("write to pipe");
-                        }
-                        curr = curr->next;
-                        r++;
-                        if (r == r_numprocs) {
-                            r = 0;
-                        }
+                // Send this reduce_worker every r_numprocs-th key, starting
+                // at key j.  Its pipe is filled before the next worker is
+                // forked, so no pipe can fill up without a reader.
+                int r = 0; // Index of each key
+                for (LLKeyValues *curr = key_values; curr != NULL; curr = curr->next) {
+                    if (r % r_numprocs == j && write(reduce_fp_fd[j][1], &curr,
+                        sizeof(LLKeyValues *)) == -1) {
+                        perror("write to pipe");
                     }
+                    r++;
                 }
 				
                 close_check(reduce_fp_fd[j][1]); // Finished writing, close write
 				
             } else if (re_pid == 0) { // Child process (will run reduce_worker)
+
+                // Close the pipes of reduce_workers not forked yet
+                for (int h = j + 1; h < r_numprocs; h++) {
+                    close_check(reduce_fp_fd[h][0]);
+                    close_check(reduce_fp_fd[h][1]);
+                }
 			
 				FILE *output_file;
 				char path[MAX_FILENAME] = "";
-				char pid[10];
 				int error = 0;
 				
 				// Create file path starting at current directory
-				strcpy(path, "./");
-				snprintf(pid, 10, "%d", getpid());   // Convert PID from int to String
-				strncat(path, pid, MAX_FILENAME);    // PID as file name
-				strncat(path, ".out", MAX_FILENAME);
-				strncat(path, "\0", 1);
+				snprintf(path, MAX_FILENAME, "./%d.out", getpid()); // PID as file name
 				
 				output_file = fopen(path, "wb"); // Write in binary
 				if (!output_file) {
@@ -0,0 +1,350 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "mapreduce.h"
+#include "linkedlist.h"
+#include "netproto.h"
+#include "outwriter.h"
+
+// Groups in one reduce task: enough that their results, each a key and a
+// value of at most MAX_KEY and MAX_VALUE bytes, fit in one frame.
+#define MAX_TASK_GROUPS ((int) (MAX_FRAME_BYTES / (2 * sizeof(uint32_t) + MAX_KEY + MAX_VALUE)))
+
+/*
+ * Master side of distributed mode.
+ *
+ * Each worker has at most one task outstanding.  A worker that finishes
+ * (MAP_DONE or RESULTS) is immediately handed the next task, so faster
+ * workers take on more of the job.
+ */
+
+/*
+ * Listen on port and accept nworkers connections.
+ * Return a malloc'd array of worker sockets.
+ */
+static int *accept_workers(int port, int nworkers) {
+    int on = 1;
+    struct sockaddr_in self;
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) {
+        perror("setsockopt -- REUSEADDR");
+    }
+
+    memset(&self, 0, sizeof(self));
+    self.sin_family = AF_INET;
+    self.sin_addr.s_addr = INADDR_ANY;
+    self.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr *)&self, sizeof(self)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    if (listen(listenfd, WORKER_BACKLOG) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    int *workers = malloc(sizeof(int) * nworkers);
+    if (workers == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    const Codec *codec = get_frame_codec();
+    const char *codec_name = codec ? codec->name : "none";
+    Batch config = {NULL, 0, 0, 0};
+    batch_put_str(&config, codec_name);
+
+    for (int w = 0; w < nworkers; w++) {
+        if ((workers[w] = accept(listenfd, NULL, NULL)) == -1) {
+            perror("accept");
+            exit(1);
+        }
+        if (send_frame(workers[w], FRAME_CONFIG, config.data, config.len) == -1) {
+            perror("send_frame");
+            exit(1);
+        }
+    }
+    batch_free(&config);
+    close(listenfd);
+    return workers;
+}
+
+/*
+ * Read the next input file name from stdin and send it to worker fd as a
+ * MAP_TASK.  Paths are sent absolute so workers need not share our cwd.
+ * Return 1 if a task was sent, 0 if there are no more input files.
+ */
+static int send_next_file(int fd, const char *dirname, Batch *out) {
+    char file_name[NAME_MAX + 1];
+    char path[PATH_MAX];
+    char abs_path[PATH_MAX];
+
+    while (scanf("%255s", file_name) > 0) {
+        snprintf(path, sizeof(path), "%s/%s", dirname, file_name);
+        if (realpath(path, abs_path) == NULL) {
+            perror(path);
+            continue;
+        }
+        batch_reset(out);
+        batch_put_str(out, abs_path);
+        if (send_frame(fd, FRAME_MAP_TASK, out->data, out->len) == -1) {
+            perror("send_frame");
+            exit(1);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Append kv's group to out: its key, how many values follow, and the
+ * values.  Once out holds BATCH_BYTES, what it has so far is sent to
+ * worker fd as a REDUCE_PART and the group carries on in an empty out,
+ * so a key with any number of values never makes a frame much bigger
+ * than BATCH_BYTES.
+ */
+static void put_group(int fd, const LLKeyValues *kv, Batch *out) {
+    const LLValues *v = kv->head_value;
+    int i = 0;
+
+    while (1) {
+        batch_put_str(out, kv->key);
+        uint32_t count_pos = out->len;
+        uint32_t nvalues = 0;
+        int done;
+        batch_put_u32(out, 0);
+        if (job_value_type == VALUE_INT64) {
+            for (; i < kv->nints && (nvalues == 0 || out->len < BATCH_BYTES); i++) {
+                batch_put_u64(out, kv->ints[i]);
+                nvalues++;
+            }
+            done = i == kv->nints;
+        } else {
+            for (; v != NULL && (nvalues == 0 || out->len < BATCH_BYTES); v = v->next) {
+                batch_put_str(out, v->value);
+                nvalues++;
+            }
+            done = v == NULL;
+        }
+        batch_set_u32(out, count_pos, nvalues);
+        if (done) {
+            return;
+        }
+
+        if (send_frame(fd, FRAME_REDUCE_PART, out->data, out->len) == -1) {
+            perror("send_frame");
+            exit(1);
+        }
+        batch_reset(out);
+    }
+}
+
+/*
+ * Pack groups from *next into one REDUCE_TASK of about BATCH_BYTES and send
+ * it to worker fd, advancing *next.  A task has at most MAX_TASK_GROUPS
+ * groups, so the RESULTS frame that answers it fits in MAX_FRAME_BYTES.
+ * Return 1 if a task was sent, 0 if there are no more keys.
+ */
+static int send_next_keys(int fd, LLKeyValues **next, Batch *out) {
+    if (*next == NULL) {
+        return 0;
+    }
+
+    batch_reset(out);
+    for (int ngroups = 0; *next != NULL && out->len < BATCH_BYTES &&
+                          ngroups < MAX_TASK_GROUPS; ngroups++) {
+        put_group(fd, *next, out);
+        *next = (*next)->next;
+    }
+
+    if (send_frame(fd, FRAME_REDUCE_TASK, out->data, out->len) == -1) {
+        perror("send_frame");
+        exit(1);
+    }
+    return 1;
+}
+
+/*
+ * Integer version of take_pairs: each record is a key and a 64-bit value.
+ */
+static void take_int_pairs(Batch *in, LLKeyValues **key_values, OutWriter *out) {
+    IntPair pair;
+    uint64_t value;
+    while (in->pos < in->len) {
+        if (batch_get_str(in, pair.key, MAX_KEY) == -1 ||
+            batch_get_u64(in, &value) == -1) {
+            fprintf(stderr, "malformed pairs frame\n");
+            exit(1);
+        }
+        pair.value = (int64_t) value;
+        if (key_values != NULL) {
+            insert_int_into_keys(key_values, pair);
+        } else {
+            writer_put_int(out, pair.key, pair.value);
+        }
+    }
+}
+
+/*
+ * Decode a PAIRS or RESULTS payload into Pairs.  PAIRS are grouped into
+ * *key_values; RESULTS are written to out.
+ */
+static void take_pairs(Batch *in, LLKeyValues **key_values, OutWriter *out) {
+    Pair pair;
+    if (job_value_type == VALUE_INT64) {
+        take_int_pairs(in, key_values, out);
+        return;
+    }
+    while (in->pos < in->len) {
+        memset(&pair, 0, sizeof(pair));
+        if (batch_get_str(in, pair.key, MAX_KEY) == -1 ||
+            batch_get_str(in, pair.value, MAX_VALUE) == -1) {
+            fprintf(stderr, "malformed pairs frame\n");
+            exit(1);
+        }
+        if (key_values != NULL) {
+            insert_into_keys(key_values, pair);
+        } else {
+            writer_put(out, &pair);
+        }
+    }
+}
+
+/*
+ * Wait for any busy worker to send a frame, and handle it.
+ * Return the index of a worker that has become idle, or -1 if the frame
+ * only carried data.
+ */
+static int poll_workers(int *workers, int *busy, int nworkers, Batch *in,
+                        LLKeyValues **key_values, OutWriter *results) {
+    struct pollfd fds[nworkers];
+    for (int w = 0; w < nworkers; w++) {
+        fds[w].fd = busy[w] ? workers[w] : -1;
+        fds[w].events = POLLIN;
+        fds[w].revents = 0;
+    }
+    if (poll(fds, nworkers, -1) == -1) {
+        perror("poll");
+        exit(1);
+    }
+
+    for (int w = 0; w < nworkers; w++) {
+        if (fds[w].revents == 0) {
+            continue;
+        }
+        uint32_t type;
+        if (recv_frame(workers[w], &type, in) != 0) {
+            fprintf(stderr, "worker %d disconnected\n", w);
+            exit(1);
+        }
+        switch (type) {
+            case FRAME_PAIRS:
+                take_pairs(in, key_values, results);
+                return -1;
+            case FRAME_MAP_DONE:
+                busy[w] = 0;
+                return w;
+            case FRAME_RESULTS:
+                take_pairs(in, NULL, results);
+                busy[w] = 0;
+                return w;
+            default:
+                fprintf(stderr, "unexpected frame type %u from worker %d\n", type, w);
+                exit(1);
+        }
+    }
+    return -1;
+}
+
+/*
+ * Tell every worker the job is done and collect the time each spent on
+ * compression.  Print a summary of shuffle volume and codec cost to stderr.
+ */
+static void finish_workers(int *workers, int nworkers, Batch *in) {
+    uint64_t worker_compress_ns = 0, worker_decompress_ns = 0;
+
+    for (int w = 0; w < nworkers; w++) {
+        uint32_t type;
+        uint64_t compress_ns, decompress_ns;
+        if (send_frame(workers[w], FRAME_SHUTDOWN, NULL, 0) == -1 ||
+            recv_frame(workers[w], &type, in) != 0 || type != FRAME_STATS ||
+            batch_get_u64(in, &compress_ns) == -1 ||
+            batch_get_u64(in, &decompress_ns) == -1) {
+            fprintf(stderr, "worker %d did not report stats\n", w);
+        } else {
+            worker_compress_ns += compress_ns;
+            worker_decompress_ns += decompress_ns;
+        }
+        close(workers[w]);
+    }
+
+    // Every shuffled frame passes through the master, so its totals cover
+    // the whole job.
+    const Codec *codec = get_frame_codec();
+    CodecStats *stats = frame_codec_stats();
+    double ratio = stats->packed_bytes ? (double) stats->raw_bytes / stats->packed_bytes : 1.0;
+    fprintf(stderr, "shuffle: codec %s, %llu bytes raw, %llu bytes sent, ratio %.2f\n",
+            codec ? codec->name : "none",
+            (unsigned long long) stats->raw_bytes,
+            (unsigned long long) stats->packed_bytes, ratio);
+    fprintf(stderr, "codec time: compress %.3f ms (master %.3f), decompress %.3f ms (master %.3f)\n",
+            (stats->compress_ns + worker_compress_ns) / 1e6, stats->compress_ns / 1e6,
+            (stats->decompress_ns + worker_decompress_ns) / 1e6, stats->decompress_ns / 1e6);
+}
+
+void run_distributed(const char *dirname, int port, int nworkers, int outfd) {
+    Batch in = {NULL, 0, 0, 0};
+    Batch out = {NULL, 0, 0, 0};
+    LLKeyValues *key_values = NULL;
+    OutWriter results;
+    int *workers = accept_workers(port, nworkers);
+    int busy[nworkers];
+    int nbusy = 0;
+
+    // Map phase
+    for (int w = 0; w < nworkers; w++) {
+        busy[w] = send_next_file(workers[w], dirname, &out);
+        nbusy += busy[w];
+    }
+    while (nbusy > 0) {
+        int w = poll_workers(workers, busy, nworkers, &in, &key_values, NULL);
+        if (w >= 0) {
+            busy[w] = send_next_file(workers[w], dirname, &out);
+            nbusy += busy[w] - 1;
+        }
+    }
+
+    // Reduce phase
+    sort_key_values(&key_values);
+    LLKeyValues *next = key_values;
+    writer_open(&results, outfd);
+    for (int w = 0; w < nworkers; w++) {
+        busy[w] = send_next_keys(workers[w], &next, &out);
+        nbusy += busy[w];
+    }
+    while (nbusy > 0) {
+        int w = poll_workers(workers, busy, nworkers, &in, NULL, &results);
+        if (w >= 0) {
+            busy[w] = send_next_keys(workers[w], &next, &out);
+            nbusy += busy[w] - 1;
+        }
+    }
+
+    writer_close(&results);
+
+    finish_workers(workers, nworkers, &in);
+    free(workers);
+    free_key_values_list(key_values);
+    batch_free(&in);
+    batch_free(&out);
+}
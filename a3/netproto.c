@@ -0,0 +1,277 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "netproto.h"
+
+static const Codec *frame_codec = NULL;
+static CodecStats frame_stats;
+static Batch scratch;   // Holds packed payloads on their way in or out.
+
+/*
+ * Write all len bytes of buf to fd, retrying on short writes.
+ */
+int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Read exactly len bytes from fd into buf.
+ */
+int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (n == 0) {
+            return got == 0 ? 1 : -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+void set_frame_codec(const Codec *codec) {
+    frame_codec = codec;
+}
+
+const Codec *get_frame_codec(void) {
+    return frame_codec;
+}
+
+CodecStats *frame_codec_stats(void) {
+    return &frame_stats;
+}
+
+/*
+ * Make sure b has room for extra more bytes.  A batch cannot hold more
+ * than UINT32_MAX bytes.
+ */
+static void batch_reserve(Batch *b, uint32_t extra) {
+    uint64_t need = (uint64_t) b->len + extra;
+    if (need <= b->cap) {
+        return;
+    }
+    if (need > UINT32_MAX) {
+        fprintf(stderr, "batch_reserve: batch would exceed %u bytes\n", UINT32_MAX);
+        exit(1);
+    }
+    uint64_t cap = b->cap ? b->cap : 256;
+    while (cap < need) {
+        cap *= 2;
+    }
+    if (cap > UINT32_MAX) {
+        cap = UINT32_MAX;
+    }
+    b->data = realloc(b->data, cap);
+    if (b->data == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    b->cap = cap;
+}
+
+/*
+ * Compress len bytes of payload into scratch as a packed payload.
+ * Return 1 if that came out smaller than the original, 0 otherwise.
+ */
+static int pack_payload(const void *payload, uint32_t len) {
+    const uint32_t header_len = 1 + sizeof(uint32_t);
+    uint32_t bound = frame_codec->bound(len);
+
+    batch_reset(&scratch);
+    batch_reserve(&scratch, header_len + bound);
+    scratch.data[0] = (char) frame_codec->id;
+    uint32_t net_len = htonl(len);
+    memcpy(scratch.data + 1, &net_len, sizeof(net_len));
+
+    uint64_t start = now_ns();
+    int32_t packed = frame_codec->compress(payload, len, scratch.data + header_len, bound);
+    frame_stats.compress_ns += now_ns() - start;
+
+    if (packed < 0 || header_len + packed >= len) {
+        return 0;
+    }
+    scratch.len = header_len + packed;
+    return 1;
+}
+
+/*
+ * Send one frame of the given type.
+ */
+int send_frame(int fd, uint32_t type, const void *payload, uint32_t len) {
+    frame_stats.raw_bytes += len;
+    if (frame_codec != NULL && frame_codec->id != CODEC_NONE &&
+        len >= PACK_MIN_BYTES && pack_payload(payload, len)) {
+        type |= FRAME_PACKED;
+        payload = scratch.data;
+        len = scratch.len;
+    }
+    frame_stats.packed_bytes += len;
+
+    uint32_t header[2] = {htonl(type), htonl(len)};
+    if (write_full(fd, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    return write_full(fd, payload, len);
+}
+
+/*
+ * Decompress the packed payload in scratch into b.
+ * Return 0 on success, -1 if it is corrupt or uses an unknown codec.
+ */
+static int unpack_payload(Batch *b) {
+    const uint32_t header_len = 1 + sizeof(uint32_t);
+    uint32_t net_len;
+
+    if (scratch.len < header_len) {
+        return -1;
+    }
+    const Codec *codec = find_codec_id((uint8_t) scratch.data[0]);
+    memcpy(&net_len, scratch.data + 1, sizeof(net_len));
+    uint32_t len = ntohl(net_len);
+    if (codec == NULL || len > MAX_FRAME_BYTES) {
+        return -1;
+    }
+
+    batch_reserve(b, len);
+    uint64_t start = now_ns();
+    int32_t got = codec->decompress(scratch.data + header_len, scratch.len - header_len,
+                                    b->data, len);
+    frame_stats.decompress_ns += now_ns() - start;
+    if (got != (int32_t) len) {
+        return -1;
+    }
+    b->len = len;
+    return 0;
+}
+
+/*
+ * Receive one frame into b.
+ */
+int recv_frame(int fd, uint32_t *type, Batch *b) {
+    uint32_t header[2];
+    int status = read_full(fd, header, sizeof(header));
+    if (status != 0) {
+        return status;
+    }
+    *type = ntohl(header[0]);
+    uint32_t len = ntohl(header[1]);
+    if (len > MAX_FRAME_BYTES) {
+        return -1;
+    }
+    frame_stats.packed_bytes += len;
+
+    batch_reset(b);
+    if (*type & FRAME_PACKED) {
+        *type &= ~FRAME_PACKED;
+        batch_reset(&scratch);
+        batch_reserve(&scratch, len);
+        if (read_full(fd, scratch.data, len) != 0) {
+            return -1;
+        }
+        scratch.len = len;
+        if (unpack_payload(b) == -1) {
+            return -1;
+        }
+    } else {
+        batch_reserve(b, len);
+        if (len > 0 && read_full(fd, b->data, len) != 0) {
+            return -1;
+        }
+        b->len = len;
+    }
+    frame_stats.raw_bytes += b->len;
+    return 0;
+}
+
+void batch_put(Batch *b, const void *src, uint32_t len) {
+    batch_reserve(b, len);
+    memcpy(b->data + b->len, src, len);
+    b->len += len;
+}
+
+void batch_put_u32(Batch *b, uint32_t v) {
+    uint32_t net = htonl(v);
+    batch_put(b, &net, sizeof(net));
+}
+
+void batch_put_u64(Batch *b, uint64_t v) {
+    batch_put_u32(b, (uint32_t) (v >> 32));
+    batch_put_u32(b, (uint32_t) v);
+}
+
+void batch_put_str(Batch *b, const char *s) {
+    uint32_t len = strlen(s);
+    batch_put_u32(b, len);
+    batch_put(b, s, len);
+}
+
+void batch_set_u32(Batch *b, uint32_t pos, uint32_t v) {
+    uint32_t net = htonl(v);
+    memcpy(b->data + pos, &net, sizeof(net));
+}
+
+int batch_get_u32(Batch *b, uint32_t *v) {
+    uint32_t net;
+    if (b->len - b->pos < sizeof(net)) {
+        return -1;
+    }
+    memcpy(&net, b->data + b->pos, sizeof(net));
+    b->pos += sizeof(net);
+    *v = ntohl(net);
+    return 0;
+}
+
+int batch_get_u64(Batch *b, uint64_t *v) {
+    uint32_t hi, lo;
+    if (batch_get_u32(b, &hi) == -1 || batch_get_u32(b, &lo) == -1) {
+        return -1;
+    }
+    *v = ((uint64_t) hi << 32) | lo;
+    return 0;
+}
+
+int batch_get_str(Batch *b, char *dst, size_t size) {
+    uint32_t len;
+    if (batch_get_u32(b, &len) == -1 || b->len - b->pos < len) {
+        return -1;
+    }
+    size_t copy = len < size - 1 ? len : size - 1;
+    memcpy(dst, b->data + b->pos, copy);
+    dst[copy] = '\0';
+    b->pos += len;
+    return 0;
+}
+
+void batch_reset(Batch *b) {
+    b->len = 0;
+    b->pos = 0;
+}
+
+void batch_free(Batch *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = b->pos = 0;
+}
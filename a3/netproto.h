@@ -0,0 +1,122 @@
+#ifndef NETPROTO_H
+#define NETPROTO_H
+
+#include <stdint.h>
+#include "mapreduce.h"
+#include "codec.h"
+
+#define BATCH_BYTES 65536   // Target payload size of one batched frame.
+#define WORKER_BACKLOG 64   // Listen backlog for incoming worker connections.
+#define PACK_MIN_BYTES 256  // Smaller payloads are never worth compressing.
+#define FRAME_PACKED 0x80000000u  // Type flag: payload is codec-compressed.
+#define MAX_FRAME_BYTES (16 * BATCH_BYTES)  // Largest payload, raw or packed, a frame may carry.
+
+/*
+ * Frame types exchanged between the master and TCP worker daemons.
+ *
+ * Every frame is an 8-byte header (type, payload length; both 32-bit,
+ * network byte order) followed by the payload.  Payloads never contain
+ * pointers: keys and values are sent as length-prefixed strings.
+ *
+ * When a codec is set, payloads of at least PACK_MIN_BYTES are compressed
+ * if that makes them smaller.  A packed frame has FRAME_PACKED set in its
+ * type, and its payload is the codec id (1 byte), the raw length (32-bit)
+ * and the compressed block.
+ *
+ * No payload, and no raw length of a packed one, may exceed
+ * MAX_FRAME_BYTES: the length comes from the peer, so it is checked
+ * before anything is allocated for it.  Senders keep well under it: a
+ * key with more values than fit in one REDUCE_TASK is sent in parts.
+ */
+enum frame_type {
+    FRAME_MAP_TASK = 1,   // master -> worker: input file path
+    FRAME_PAIRS,          // worker -> master: batch of (key, value) records
+    FRAME_MAP_DONE,       // worker -> master: finished the last map task
+    FRAME_REDUCE_TASK,    // master -> worker: batch of (key, values...) groups
+    FRAME_RESULTS,        // worker -> master: batch of reduced (key, value) records
+    FRAME_SHUTDOWN,       // master -> worker: job finished, disconnect
+    FRAME_CONFIG,         // master -> worker: name of the codec to use
+    FRAME_STATS,          // worker -> master: worker's CodecStats, after SHUTDOWN
+    FRAME_REDUCE_PART     // master -> worker: as REDUCE_TASK, but its last group
+                          //   continues in the next frame; no RESULTS until then
+};
+
+// A growable byte buffer used to build and parse frame payloads.
+typedef struct batch {
+    char *data;
+    uint32_t len;   // bytes in use
+    uint32_t cap;   // bytes allocated
+    uint32_t pos;   // read cursor, used when decoding
+} Batch;
+
+/*
+ * Write all len bytes of buf to fd, retrying on short writes.
+ * Return 0 on success, -1 on error.
+ */
+int write_full(int fd, const void *buf, size_t len);
+
+/*
+ * Read exactly len bytes from fd into buf.
+ * Return 0 on success, 1 on a clean EOF before any byte, -1 on error.
+ */
+int read_full(int fd, void *buf, size_t len);
+
+/*
+ * Set the codec used to compress outgoing frames (NULL for none), and get
+ * the totals for all frames sent and received by this process.
+ */
+void set_frame_codec(const Codec *codec);
+const Codec *get_frame_codec(void);
+CodecStats *frame_codec_stats(void);
+
+/*
+ * Send one frame of the given type.  Return 0 on success, -1 on error.
+ */
+int send_frame(int fd, uint32_t type, const void *payload, uint32_t len);
+
+/*
+ * Receive one frame into b (replacing its contents and resetting its read
+ * cursor), decompressing it if it was packed.
+ * Return 0 on success, 1 on EOF, -1 on error (including a frame over
+ * MAX_FRAME_BYTES).
+ */
+int recv_frame(int fd, uint32_t *type, Batch *b);
+
+/*
+ * Append raw bytes, a 32-bit integer or a length-prefixed string to b.
+ */
+void batch_put(Batch *b, const void *src, uint32_t len);
+void batch_put_u32(Batch *b, uint32_t v);
+void batch_put_u64(Batch *b, uint64_t v);
+void batch_put_str(Batch *b, const char *s);
+
+/*
+ * Overwrite the 32-bit integer at offset pos of b, which must already be
+ * in use: used to fill in a count once it is known.
+ */
+void batch_set_u32(Batch *b, uint32_t pos, uint32_t v);
+
+/*
+ * Read a 32-bit integer or a length-prefixed string from b, advancing its
+ * cursor.  The string is copied into dst (at most size bytes including the
+ * null-terminator) and truncated if necessary.
+ * Return 0 on success, -1 if the payload is malformed.
+ */
+int batch_get_u32(Batch *b, uint32_t *v);
+int batch_get_u64(Batch *b, uint64_t *v);
+int batch_get_str(Batch *b, char *dst, size_t size);
+
+/*
+ * Empty b without releasing its memory, or release it entirely.
+ */
+void batch_reset(Batch *b);
+void batch_free(Batch *b);
+
+/*
+ * Run a whole job against nworkers TCP worker daemons connecting on port.
+ * Input file names are read from stdin (one per line, relative to dirname).
+ * Reduced pairs are written to outfd.
+ */
+void run_distributed(const char *dirname, int port, int nworkers, int outfd);
+
+#endif
@@ -0,0 +1,249 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include "mapreduce.h"
+
+/*
+ * N-gram frequency job.
+ *
+ * The key is a run of n consecutive words joined by single spaces (n comes
+ * from the NGRAM_N environment variable, default 2), and the value is its
+ * count.  Words are lower-cased with punctuation removed, as in word_freq.
+ *
+ * map() sees a file one READSIZE chunk at a time, so the last n - 1 words
+ * and any half-read word are carried over to the next chunk.  map_worker
+ * passes an empty chunk at the end of each file, which flushes that state.
+ *
+ * Counts are combined in the map process before they are sent: a small
+ * hash table sums repeated n-grams and is emitted when it fills up or the
+ * file ends, so pipe traffic grows with distinct n-grams, not with words.
+ */
+
+#define MAX_N 8                 // Largest supported n.
+#define DEFAULT_N 2
+#define COMBINE_MAX 4096        // Distinct n-grams held before an early flush.
+#define COMBINE_SLOTS (2 * COMBINE_MAX)   // Power of two.
+#define HASH_SUFFIX_LEN 17      // "#" + 16 hex digits.
+
+const int job_value_type = VALUE_INT64;
+
+typedef struct combine_entry {
+    char key[MAX_KEY];
+    int64_t count;              // 0 marks an empty slot.
+} CombineEntry;
+
+static int ngram_n = 0;         // 0 until read from the environment.
+static char window[MAX_N][MAX_KEY];   // Last words seen, oldest first.
+static int window_len = 0;
+static char partial[MAX_KEY];   // Word cut off by the end of a chunk.
+static int partial_len = 0;
+static CombineEntry *combine_table = NULL;
+static int combine_used = 0;
+static int emit_ints = 1;       // 0 when called through the string map().
+
+/*
+ * 64-bit FNV-1a hash of s.
+ */
+static uint64_t hash_string(const char *s) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*s != '\0') {
+        h ^= (unsigned char) *s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int get_n(void) {
+    if (ngram_n == 0) {
+        const char *env = getenv("NGRAM_N");
+        ngram_n = env ? strtol(env, NULL, 10) : DEFAULT_N;
+        if (ngram_n < 1 || ngram_n > MAX_N) {
+            fprintf(stderr, "NGRAM_N must be between 1 and %d\n", MAX_N);
+            exit(1);
+        }
+    }
+    return ngram_n;
+}
+
+/*
+ * Write every combined count to outfd and empty the table.
+ */
+static void combine_flush(int outfd) {
+    if (combine_table == NULL) {
+        return;
+    }
+    for (int i = 0; i < COMBINE_SLOTS; i++) {
+        CombineEntry *e = &combine_table[i];
+        if (e->count == 0) {
+            continue;
+        }
+        if (emit_ints) {
+            IntPair pair;
+            memcpy(pair.key, e->key, MAX_KEY);
+            pair.value = e->count;
+            write(outfd, &pair, sizeof(IntPair));
+        } else {
+            Pair pair;
+            memcpy(pair.key, e->key, MAX_KEY);
+            snprintf(pair.value, MAX_VALUE, "%" PRId64, e->count);
+            write(outfd, &pair, sizeof(Pair));
+        }
+        e->count = 0;
+    }
+    combine_used = 0;
+}
+
+/*
+ * Add one occurrence of key to the table.
+ */
+static void combine_add(const char *key, int outfd) {
+    if (combine_table == NULL) {
+        combine_table = calloc(COMBINE_SLOTS, sizeof(CombineEntry));
+        if (combine_table == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+    }
+
+    unsigned slot = hash_string(key) & (COMBINE_SLOTS - 1);
+    while (combine_table[slot].count != 0) {
+        if (strcmp(combine_table[slot].key, key) == 0) {
+            combine_table[slot].count++;
+            return;
+        }
+        slot = (slot + 1) & (COMBINE_SLOTS - 1);
+    }
+
+    if (combine_used == COMBINE_MAX) {
+        combine_flush(outfd);
+        slot = hash_string(key) & (COMBINE_SLOTS - 1);
+    }
+    strncpy(combine_table[slot].key, key, MAX_KEY);
+    combine_table[slot].count = 1;
+    combine_used++;
+}
+
+/*
+ * Build the key for the n-gram in window.  N-grams too long for MAX_KEY
+ * are truncated and tagged with a hash of the full text, so distinct long
+ * n-grams stay distinct.
+ */
+static void make_key(char *key) {
+    char text[MAX_N * MAX_KEY];
+    int len = 0;
+    for (int i = 0; i < window_len; i++) {
+        if (i > 0) {
+            text[len++] = ' ';
+        }
+        int word_len = strlen(window[i]);
+        memcpy(text + len, window[i], word_len);
+        len += word_len;
+    }
+    text[len] = '\0';
+
+    if (len < MAX_KEY) {
+        memcpy(key, text, len + 1);
+    } else {
+        int keep = MAX_KEY - 1 - HASH_SUFFIX_LEN;
+        memcpy(key, text, keep);
+        snprintf(key + keep, HASH_SUFFIX_LEN + 1, "#%016" PRIx64, hash_string(text));
+    }
+}
+
+/*
+ * Slide the window forward by one word and count the n-gram it now holds.
+ */
+static void push_word(const char *word, int outfd) {
+    int n = get_n();
+    if (window_len == n) {
+        memmove(window[0], window[1], sizeof(window[0]) * (n - 1));
+        window_len--;
+    }
+    strncpy(window[window_len], word, MAX_KEY);
+    window_len++;
+
+    if (window_len == n) {
+        char key[MAX_KEY];
+        make_key(key);
+        combine_add(key, outfd);
+    }
+}
+
+/*
+ * Finish the current word, if any.
+ */
+static void end_word(int outfd) {
+    if (partial_len > 0) {
+        partial[partial_len] = '\0';
+        push_word(partial, outfd);
+        partial_len = 0;
+    }
+}
+
+/*
+ * Feed one chunk through the tokenizer.  An empty chunk marks the end of
+ * a file: the last word is finished, counts are flushed and the window is
+ * cleared so n-grams never span two files.
+ */
+static void map_chunk(const char *chunk, int outfd) {
+    if (*chunk == '\0') {
+        end_word(outfd);
+        combine_flush(outfd);
+        window_len = 0;
+        return;
+    }
+
+    for (const char *cptr = chunk; *cptr != '\0'; cptr++) {
+        if (isspace(*cptr)) {
+            end_word(outfd);
+        } else if (!ispunct(*cptr) && partial_len < MAX_KEY - 1) {
+            partial[partial_len++] = tolower(*cptr);
+        }
+    }
+}
+
+/*
+ * Write a sequence of Pairs to outfd, where the first element of the
+ * pair is an n-gram and the second is how often it occurred.
+ */
+void map(const char *chunk, int outfd) {
+    emit_ints = 0;
+    map_chunk(chunk, outfd);
+}
+
+/*
+ * Integer version of map.
+ */
+void map_int(const char *chunk, int outfd) {
+    emit_ints = 1;
+    map_chunk(chunk, outfd);
+}
+
+/*
+ * The key is an n-gram, and the values are partial counts of it.
+ */
+Pair reduce(const char *key, const LLValues *head_value) {
+    int64_t result = 0;
+    for (const LLValues *curr = head_value; curr != NULL; curr = curr->next) {
+        result += strtoll(curr->value, NULL, 10);
+    }
+    Pair pair;
+    strncpy(pair.key, key, MAX_KEY);
+    pair.key[MAX_KEY - 1] = '\0';
+    snprintf(pair.value, MAX_VALUE, "%" PRId64, result);
+    return pair;
+}
+
+/*
+ * Integer version of reduce: the count is the sum of the partial counts.
+ */
+int64_t reduce_int(const char *key, const int64_t *values, int nvalues) {
+    int64_t result = 0;
+    for (int i = 0; i < nvalues; i++) {
+        result += values[i];
+    }
+    return result;
+}
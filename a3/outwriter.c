@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "outwriter.h"
+
+static enum out_format out_format = OUT_BINARY;
+static enum fsync_policy fsync_policy = SYNC_NONE;
+
+void set_output_options(enum out_format format, enum fsync_policy sync) {
+    out_format = format;
+    fsync_policy = sync;
+}
+
+int parse_out_format(const char *name) {
+    if (strcmp(name, "bin") == 0) {
+        return OUT_BINARY;
+    } else if (strcmp(name, "tsv") == 0) {
+        return OUT_TSV;
+    }
+    return -1;
+}
+
+int parse_fsync_policy(const char *name) {
+    if (strcmp(name, "none") == 0) {
+        return SYNC_NONE;
+    } else if (strcmp(name, "end") == 0) {
+        return SYNC_END;
+    } else if (strcmp(name, "flush") == 0) {
+        return SYNC_FLUSH;
+    }
+    return -1;
+}
+
+void writer_open(OutWriter *w, int fd) {
+    void *buf;
+    if (posix_memalign(&buf, OUT_ALIGN, OUT_BUFSIZE) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    w->fd = fd;
+    w->buf = buf;
+    w->len = 0;
+}
+
+/*
+ * Write out everything buffered so far.
+ */
+static void writer_flush(OutWriter *w) {
+    size_t done = 0;
+    while (done < w->len) {
+        ssize_t n = write(w->fd, w->buf + done, w->len - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        done += n;
+    }
+    w->len = 0;
+
+    if (fsync_policy == SYNC_FLUSH && fsync(w->fd) == -1) {
+        perror("fsync");
+    }
+}
+
+/*
+ * Append len bytes to the buffer, flushing first if they do not fit.
+ */
+static void writer_append(OutWriter *w, const char *src, size_t len) {
+    if (w->len + len > OUT_BUFSIZE) {
+        writer_flush(w);
+    }
+    memcpy(w->buf + w->len, src, len);
+    w->len += len;
+}
+
+void writer_put(OutWriter *w, const Pair *pair) {
+    if (out_format == OUT_BINARY) {
+        writer_append(w, (const char *) pair, sizeof(Pair));
+        return;
+    }
+
+    // Key and value are both null-terminated and bounded by MAX_KEY and
+    // MAX_VALUE, so a line always fits in one buffer.
+    size_t key_len = strnlen(pair->key, MAX_KEY);
+    size_t value_len = strnlen(pair->value, MAX_VALUE);
+    if (w->len + key_len + value_len + 2 > OUT_BUFSIZE) {
+        writer_flush(w);
+    }
+    char *p = w->buf + w->len;
+    memcpy(p, pair->key, key_len);
+    p[key_len] = '\t';
+    memcpy(p + key_len + 1, pair->value, value_len);
+    p[key_len + 1 + value_len] = '\n';
+    w->len += key_len + value_len + 2;
+}
+
+/*
+ * Write value in decimal to dst, which must have room for 21 bytes.
+ * Return the number of characters written (no null-terminator).
+ */
+static int format_int(char *dst, int64_t value) {
+    char digits[20];
+    int n = 0, len = 0;
+    uint64_t v = value < 0 ? -(uint64_t) value : (uint64_t) value;
+
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    if (value < 0) {
+        dst[len++] = '-';
+    }
+    while (n > 0) {
+        dst[len++] = digits[--n];
+    }
+    return len;
+}
+
+void writer_put_int(OutWriter *w, const char *key, int64_t value) {
+    if (out_format == OUT_BINARY) {
+        Pair pair;
+        strncpy(pair.key, key, MAX_KEY);
+        pair.key[MAX_KEY - 1] = '\0';
+        int len = format_int(pair.value, value);
+        memset(pair.value + len, 0, MAX_VALUE - len);
+        writer_append(w, (const char *) &pair, sizeof(Pair));
+        return;
+    }
+
+    size_t key_len = strnlen(key, MAX_KEY - 1);
+    if (w->len + key_len + 23 > OUT_BUFSIZE) {
+        writer_flush(w);
+    }
+    char *p = w->buf + w->len;
+    memcpy(p, key, key_len);
+    p[key_len] = '\t';
+    int len = format_int(p + key_len + 1, value);
+    p[key_len + 1 + len] = '\n';
+    w->len += key_len + len + 2;
+}
+
+void writer_close(OutWriter *w) {
+    if (w->len > 0) {
+        writer_flush(w);
+    }
+    if (fsync_policy == SYNC_END && fsync(w->fd) == -1) {
+        perror("fsync");
+    }
+    free(w->buf);
+    w->buf = NULL;
+}
@@ -0,0 +1,65 @@
+#ifndef OUTWRITER_H
+#define OUTWRITER_H
+
+#include <stddef.h>
+#include "mapreduce.h"
+
+#define OUT_ALIGN 4096             // Buffer alignment; one filesystem block.
+#define OUT_BUFSIZE (1 << 20)      // Bytes collected before each write().
+
+// How reduced pairs are written out.
+enum out_format {
+    OUT_BINARY,   // raw Pair structs, as read back by the original tools
+    OUT_TSV       // "key\tvalue\n" text
+};
+
+// When output is forced to disk.
+enum fsync_policy {
+    SYNC_NONE,    // leave it to the kernel
+    SYNC_END,     // once, when the writer is closed
+    SYNC_FLUSH    // after every buffer flush
+};
+
+// Buffers reduced pairs so output costs one write() per OUT_BUFSIZE bytes.
+typedef struct out_writer {
+    int fd;
+    char *buf;      // OUT_ALIGN-aligned, OUT_BUFSIZE bytes
+    size_t len;     // bytes waiting in buf
+} OutWriter;
+
+/*
+ * Choose the format and fsync policy used by every writer opened after
+ * this call.  The master sets these before forking the reduce workers.
+ */
+void set_output_options(enum out_format format, enum fsync_policy sync);
+
+/*
+ * Parse a format ("bin" or "tsv") or fsync policy ("none", "end" or
+ * "flush") name.  Return -1 if the name is not recognized.
+ */
+int parse_out_format(const char *name);
+int parse_fsync_policy(const char *name);
+
+/*
+ * Start buffering output for fd.
+ */
+void writer_open(OutWriter *w, int fd);
+
+/*
+ * Add one reduced pair to the output.
+ */
+void writer_put(OutWriter *w, const Pair *pair);
+
+/*
+ * Add one reduced integer result to the output.  The value is formatted
+ * straight into the buffer (or into the Pair's value field).
+ */
+void writer_put_int(OutWriter *w, const char *key, int64_t value);
+
+/*
+ * Write out anything still buffered, apply the fsync policy and release
+ * the buffer.  fd itself is left open.
+ */
+void writer_close(OutWriter *w);
+
+#endif
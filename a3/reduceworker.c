@@ -4,21 +4,32 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include "mapreduce.h"
+#include "outwriter.h"
 
 /*
  * Reduce worker process
+ *
+ * Results are collected in an OutWriter so writing them costs one write()
+ * per OUT_BUFSIZE bytes rather than one per key.
  */
 void reduce_worker(int outfd, int infd) {
     
 	LLKeyValues *curr = NULL; 
     Pair new_pair;
+    OutWriter writer;
+
+    writer_open(&writer, outfd);
 	
     // Read until there are no more pairs in pipe 
     while (read(infd, &curr, sizeof(LLKeyValues *)) > 0) {
-        new_pair = reduce(curr->key, curr->head_value);
-		write(outfd, &new_pair, sizeof(Pair));
-        //fwrite(new_pair.key, MAX_KEY, 1, output_file);
-        //fwrite(new_pair.value, MAX_VALUE, 1, output_file);
+        if (job_value_type == VALUE_INT64) {
+            writer_put_int(&writer, curr->key,
+                           reduce_int(curr->key, curr->ints, curr->nints));
+        } else {
+            new_pair = reduce(curr->key, curr->head_value);
+            writer_put(&writer, &new_pair);
+        }
     }
 
+    writer_close(&writer);
 }
@@ -6,11 +6,12 @@
 #include "mapreduce.h"
 
 
+const int job_value_type = VALUE_INT64;
+
 /*
  * Precondition: chunk is null-terminated.
  *
- * Write a sequence of Pairs to outfd, where the first element of the
- * pair is a word in the string, and the second element is 1.
+ * Call emit(word, outfd) for every word in the string.
  *
  * Note: the algorithm to remove spaces and punctuation will let the
  * empty string sneak through if a punctuation mark is surrounded by
@@ -18,8 +19,9 @@
  *
  * [Updated March 16]
  */
-void map(const char *chunk, int outfd) {
-    Pair pair = {"", "1"};
+static void for_each_word(const char *chunk, int outfd,
+                          void (*emit)(const char *word, int outfd)) {
+    char word[MAX_KEY];
     int index = 0;
     const char *cptr = chunk;
 
@@ -35,8 +37,8 @@ void map(const char *chunk, int outfd) {
                 cptr++;
                 continue;
             } else {
-                pair.key[index] = '\0';
-                write(outfd, &pair, sizeof(Pair));
+                word[index] = '\0';
+                emit(word, outfd);
                 while (isspace(*cptr)) {
                     cptr++;
                 }
@@ -47,19 +49,48 @@ void map(const char *chunk, int outfd) {
             cptr++;
         // otherwise add the character to our current word.
         } else {
-            pair.key[index] = tolower(*cptr);
+            if (index < MAX_KEY - 1) { // overlong words are truncated
+                word[index] = tolower(*cptr);
+                index++;
+            }
             cptr++;
-            index++;
         }
     }
 
     // write the last word
-    pair.key[index] = '\0';
+    word[index] = '\0';
     if (index > 0) {
-        write(outfd, &pair, sizeof(Pair));
+        emit(word, outfd);
     }
 }
 
+static void emit_pair(const char *word, int outfd) {
+    Pair pair = {"", "1"};
+    strncpy(pair.key, word, MAX_KEY);
+    write(outfd, &pair, sizeof(Pair));
+}
+
+static void emit_int_pair(const char *word, int outfd) {
+    IntPair pair = {"", 1};
+    strncpy(pair.key, word, MAX_KEY);
+    write(outfd, &pair, sizeof(IntPair));
+}
+
+/*
+ * Write a sequence of Pairs to outfd, where the first element of the
+ * pair is a word in the string, and the second element is 1.
+ */
+void map(const char *chunk, int outfd) {
+    for_each_word(chunk, outfd, emit_pair);
+}
+
+/*
+ * Integer version of map: the count is sent as a native 1.
+ */
+void map_int(const char *chunk, int outfd) {
+    for_each_word(chunk, outfd, emit_int_pair);
+}
+
 
 /* The key is a word, and the value is a list of key/value Pairs
  * that have this key. Each value is the count of the word
@@ -83,3 +114,16 @@ Pair reduce(const char *key, const LLValues *head_value) {
     pair.value[MAX_VALUE - 1] = '\0';
     return pair;
 }
+
+
+/*
+ * Integer version of reduce: the count is the sum of the values.
+ * The values are contiguous, so the compiler can vectorize the loop.
+ */
+int64_t reduce_int(const char *key, const int64_t *values, int nvalues) {
+    int64_t result = 0;
+    for (int i = 0; i < nvalues; i++) {
+        result += values[i];
+    }
+    return result;
+}
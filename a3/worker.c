@@ -0,0 +1,326 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "mapreduce.h"
+#include "netproto.h"
+
+#define SPILL_PAIRS 64   // Number of spilled Pairs to read back at a time.
+
+/*
+ * Worker daemon for distributed mode.
+ *
+ * Connects to a master started with "mapreduce -p port -w numworkers",
+ * runs the map and reduce functions on the tasks it is sent, and streams
+ * the results back in batched frames.  Between jobs the daemon reconnects
+ * to the master, so the same workers can serve job after job.
+ */
+
+/*
+ * Connect to the master at host:port.  Return the socket, or -1 on error.
+ */
+int connect_master(const char *host, const char *port) {
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*
+ * Send the current batch as one frame of the given type and empty it.
+ */
+void flush_batch(int fd, uint32_t type, Batch *out) {
+    if (send_frame(fd, type, out->data, out->len) == -1) {
+        perror("send_frame");
+        exit(1);
+    }
+    batch_reset(out);
+}
+
+/*
+ * Map one input file.  map() writes fixed-size Pairs to an fd, so they are
+ * spilled to a temporary file first and then sent to the master as
+ * length-prefixed records, BATCH_BYTES at a time.  Integer jobs spill
+ * IntPairs and send each value as a 64-bit integer.
+ */
+void run_map_task(int fd, const char *path, Batch *out) {
+    char buffer[READSIZE + 1];
+    FILE *input_file = fopen(path, "r");
+    FILE *spill = tmpfile();
+
+    if (!spill) {
+        perror("tmpfile");
+        exit(1);
+    }
+
+    if (!input_file) {
+        perror(path);
+    } else {
+        // As in map_worker, the last chunk passed is empty to mark the end
+        size_t nread;
+        do {
+            nread = fread(buffer, 1, READSIZE, input_file);
+            buffer[nread] = '\0';
+            if (job_value_type == VALUE_INT64) {
+                map_int(buffer, fileno(spill));
+            } else {
+                map(buffer, fileno(spill));
+            }
+        } while (nread > 0);
+        fclose(input_file);
+    }
+
+    Pair pairs[SPILL_PAIRS];
+    IntPair int_pairs[SPILL_PAIRS];
+    ssize_t nbytes;
+    lseek(fileno(spill), 0, SEEK_SET);
+    if (job_value_type == VALUE_INT64) {
+        while ((nbytes = read(fileno(spill), int_pairs, sizeof(int_pairs))) > 0) {
+            for (int i = 0; i < nbytes / (ssize_t) sizeof(IntPair); i++) {
+                batch_put_str(out, int_pairs[i].key);
+                batch_put_u64(out, int_pairs[i].value);
+            }
+            if (out->len >= BATCH_BYTES) {
+                flush_batch(fd, FRAME_PAIRS, out);
+            }
+        }
+    } else {
+        while ((nbytes = read(fileno(spill), pairs, sizeof(pairs))) > 0) {
+            for (int i = 0; i < nbytes / (ssize_t) sizeof(Pair); i++) {
+                batch_put_str(out, pairs[i].key);
+                batch_put_str(out, pairs[i].value);
+            }
+            if (out->len >= BATCH_BYTES) {
+                flush_batch(fd, FRAME_PAIRS, out);
+            }
+        }
+    }
+    fclose(spill);
+
+    if (out->len > 0) {
+        flush_batch(fd, FRAME_PAIRS, out);
+    }
+    flush_batch(fd, FRAME_MAP_DONE, out);
+}
+
+/*
+ * Values of the group being reduced.  A group cut across frames keeps
+ * collecting here until its last part arrives.
+ */
+static char held_key[MAX_KEY];
+static int holding = 0;         // 1 while the rest of held_key's group is to come
+static LLValues *held_values;   // string jobs
+static int64_t *held_ints;      // integer jobs
+static uint32_t nheld = 0;
+static uint32_t cap_held = 0;
+
+/*
+ * Append the next nvalues values in in to the held values.
+ */
+static void hold_values(Batch *in, uint32_t nvalues) {
+    // Every value takes at least 4 bytes of the frame, so a count it
+    // cannot hold is a lie; check before allocating anything for it.
+    if (nvalues > (in->len - in->pos) / sizeof(uint32_t)) {
+        fprintf(stderr, "malformed reduce task\n");
+        exit(1);
+    }
+    if (nheld + nvalues > cap_held) {
+        uint32_t cap = cap_held ? cap_held : 64;
+        while (cap < nheld + nvalues) {
+            cap *= 2;
+        }
+        void *grown = job_value_type == VALUE_INT64
+                      ? realloc(held_ints, sizeof(int64_t) * cap)
+                      : realloc(held_values, sizeof(LLValues) * cap);
+        if (grown == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        if (job_value_type == VALUE_INT64) {
+            held_ints = grown;
+        } else {
+            held_values = grown;
+        }
+        cap_held = cap;
+    }
+
+    for (uint32_t i = 0; i < nvalues; i++, nheld++) {
+        int status;
+        if (job_value_type == VALUE_INT64) {
+            uint64_t v;
+            status = batch_get_u64(in, &v);
+            held_ints[nheld] = (int64_t) v;
+        } else {
+            status = batch_get_str(in, held_values[nheld].value, MAX_VALUE);
+        }
+        if (status == -1) {
+            fprintf(stderr, "malformed reduce task\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Reduce the held values of key, append the result to out, and let go of
+ * the values.
+ */
+static void reduce_held(const char *key, Batch *out) {
+    if (job_value_type == VALUE_INT64) {
+        batch_put_str(out, key);
+        batch_put_u64(out, reduce_int(key, held_ints, nheld));
+    } else {
+        for (uint32_t i = 0; i < nheld; i++) {
+            held_values[i].next = (i + 1 < nheld) ? &held_values[i + 1] : NULL;
+        }
+        Pair pair = reduce(key, nheld ? held_values : NULL);
+        batch_put_str(out, pair.key);
+        batch_put_str(out, pair.value);
+    }
+    nheld = 0;
+}
+
+/*
+ * Reduce every (key, values...) group in one REDUCE_TASK payload and send
+ * the reduced pairs back as a single RESULTS frame.  A REDUCE_PART payload
+ * (last is 0) is reduced the same way except for its last group, which is
+ * held for the frame after it, and nothing is sent yet.
+ */
+void run_reduce_task(int fd, Batch *in, Batch *out, int last) {
+    char key[MAX_KEY];
+    uint32_t nvalues;
+
+    while (in->pos < in->len) {
+        if (batch_get_str(in, key, MAX_KEY) == -1 ||
+            batch_get_u32(in, &nvalues) == -1 ||
+            (holding && strcmp(key, held_key) != 0)) {
+            fprintf(stderr, "malformed reduce task\n");
+            exit(1);
+        }
+        hold_values(in, nvalues);
+        holding = !last && in->pos == in->len;
+        if (holding) {
+            strcpy(held_key, key);
+        } else {
+            reduce_held(key, out);
+        }
+    }
+    if (last) {
+        flush_batch(fd, FRAME_RESULTS, out);
+    }
+}
+
+/*
+ * Serve tasks from one master until it sends SHUTDOWN or disconnects.
+ */
+void serve_job(int fd) {
+    Batch in = {NULL, 0, 0, 0};
+    Batch out = {NULL, 0, 0, 0};
+    char path[PATH_MAX];
+    uint32_t type;
+
+    holding = 0;    // a group cut short by the last master is dropped
+    nheld = 0;
+    while (recv_frame(fd, &type, &in) == 0) {
+        if (type == FRAME_MAP_TASK) {
+            if (batch_get_str(&in, path, sizeof(path)) == -1) {
+                fprintf(stderr, "malformed map task\n");
+                exit(1);
+            }
+            run_map_task(fd, path, &out);
+        } else if (type == FRAME_REDUCE_TASK || type == FRAME_REDUCE_PART) {
+            run_reduce_task(fd, &in, &out, type == FRAME_REDUCE_TASK);
+        } else if (type == FRAME_CONFIG) {
+            char name[MAX_KEY];
+            const Codec *codec;
+            if (batch_get_str(&in, name, sizeof(name)) == -1 ||
+                (codec = find_codec(name)) == NULL) {
+                fprintf(stderr, "unknown codec requested by master\n");
+                exit(1);
+            }
+            set_frame_codec(codec);
+        } else if (type == FRAME_SHUTDOWN) {
+            // Report codec time so the master can include it in its summary.
+            CodecStats *stats = frame_codec_stats();
+            batch_put_u64(&out, stats->compress_ns);
+            batch_put_u64(&out, stats->decompress_ns);
+            flush_batch(fd, FRAME_STATS, &out);
+            memset(stats, 0, sizeof(*stats));
+            break;
+        } else {
+            fprintf(stderr, "unexpected frame type %u\n", type);
+            break;
+        }
+    }
+
+    batch_free(&in);
+    batch_free(&out);
+}
+
+int main(int argc, char *argv[]) {
+    char *host = "localhost";
+    char *port = NULL;
+    int once = 0;   // 1 to exit after serving a single job
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:1")) != -1) {
+        switch (opt) {
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case '1':
+                once = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: mrworker -p port [-h host] [-1]\n");
+                exit(1);
+        }
+    }
+
+    if (port == NULL) {
+        fprintf(stderr, "Usage: mrworker -p port [-h host] [-1]\n");
+        exit(1);
+    }
+
+    while (1) {
+        int fd = connect_master(host, port);
+        if (fd == -1) {
+            sleep(1);   // Master not up yet; try again.
+            continue;
+        }
+        serve_job(fd);
+        close(fd);
+        if (once) {
+            break;
+        }
+    }
+    return 0;
+}
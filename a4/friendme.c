@@ -49,9 +49,6 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
             case 1:
                 error("users are already friends");
                 break;
-            case 2:
-                error("at least one user you entered has the max number of friends");
-                break;
             case 3:
                 error("you must enter two different users");
                 break;
@@ -90,6 +87,7 @@ int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr) {
                 error("at least one user you entered does not exist");
                 break;
         }
+        free(contents);
     } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
         User *user = find_user(cmd_argv[1], user_list);
         char *buf = NULL;
@@ -1,7 +1,214 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "friends.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Write the asctime() form of date into buf, which must hold DATE_TEXT
+ * bytes.  Converting to local time takes the C library's time zone lock
+ * and asctime_r() is a printf, so the text for the start of the last hour
+ * converted is kept, and a date in the same hour only has its minutes and
+ * seconds patched in.  Posts are made in bursts, so most dates hit.  Only
+ * make_post_at() calls this, under the write lock.
+ */
+static void format_date(time_t date, char *buf) {
+    static time_t hour_start = 0;
+    static char hour_text[DATE_TEXT];   // "Www Mmm dd hh:00:00 yyyy\n"
+    static int have_hour = 0;
+
+    if (!have_hour || date < hour_start || date - hour_start >= 3600) {
+        struct tm tm, first, last;
+        localtime_r(&date, &tm);
+        asctime_r(&tm, buf);
+
+        // The hour can be reused if the clock runs straight through it (no
+        // daylight saving change inside), and if a four-digit year puts
+        // the minutes where they are patched.
+        hour_start = date - tm.tm_min * 60 - tm.tm_sec;
+        time_t hour_end = hour_start + 3599;
+        localtime_r(&hour_start, &first);
+        localtime_r(&hour_end, &last);
+        have_hour = strlen(buf) == DATE_TEXT - 1 && first.tm_min == 0 && first.tm_sec == 0 &&
+                    first.tm_hour == tm.tm_hour && last.tm_min == 59 && last.tm_sec == 59 &&
+                    last.tm_hour == tm.tm_hour;
+        if (have_hour) {
+            memcpy(hour_text, buf, DATE_TEXT);
+        }
+        return;
+    }
+    int minutes = (date - hour_start) / 60, seconds = (date - hour_start) % 60;
+    memcpy(buf, hour_text, DATE_TEXT);
+    buf[14] = '0' + minutes / 10;
+    buf[15] = '0' + minutes % 10;
+    buf[17] = '0' + seconds / 10;
+    buf[18] = '0' + seconds % 10;
+}
+
+/*
+ * Hash index over the user list, so that looking a name up costs O(1)
+ * instead of a scan of every user.  The list itself is only walked by
+ * list_users(), which keeps users in the order they were created.
+ */
+static User **index_slots = NULL;
+static size_t index_size = 0;       // Number of slots, a power of two.
+static size_t index_used = 0;
+static const User *index_head = NULL;   // Head of the list the index describes.
+static User *index_tail = NULL;     // Last user in that list.
+
+static size_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name != '\0') {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Return the slot where name is, or where it would go.
+ */
+static size_t index_find(const char *name) {
+    size_t slot = hash_name(name) & (index_size - 1);
+    while (index_slots[slot] != NULL && strcmp(index_slots[slot]->name, name) != 0) {
+        slot = (slot + 1) & (index_size - 1);
+    }
+    return slot;
+}
+
+/*
+ * Crit-bit tree over the same users' names, for finding every name that
+ * starts with a prefix.  Each internal node holds the position of the
+ * first bit in which its two subtrees' names differ; leaves are the users
+ * themselves.  So a tree of n users is n - 1 small nodes, and a search
+ * walks one path down and then just the subtree of matching names, in
+ * order.
+ */
+struct critbit_node {
+    void *child[2];     // a User, or a node with its lowest bit set
+    uint32_t byte;      // where the names differ: this byte
+    uint8_t otherbits;  // and the bit not set here
+};
+
+static void *trie_root = NULL;
+static const User *trie_head = NULL;    // Head of the list the tree holds.
+
+#define IS_NODE(p) ((uintptr_t) (p) & 1)
+#define TO_NODE(p) ((struct critbit_node *) ((uintptr_t) (p) - 1))
+
+/*
+ * Return which child of node the name of length len belongs under.
+ */
+static int critbit_direction(const struct critbit_node *node, const char *name, size_t len) {
+    uint8_t c = node->byte < len ? name[node->byte] : 0;
+    return (1 + (node->otherbits | c)) >> 8;
+}
+
+/*
+ * Add user to the tree.  Its name must not be there already.
+ */
+static void trie_insert(User *user) {
+    const char *name = user->name;
+    size_t len = strlen(name);
+    if (trie_root == NULL) {
+        trie_root = user;
+        return;
+    }
+
+    // Find the name the new one shares the most leading bits with.
+    void *p = trie_root;
+    while (IS_NODE(p)) {
+        struct critbit_node *node = TO_NODE(p);
+        p = node->child[critbit_direction(node, name, len)];
+    }
+    const char *best = ((User *) p)->name;
+    uint32_t byte = 0;
+    while (name[byte] == best[byte]) {
+        byte++;
+    }
+    uint32_t otherbits = (uint8_t) (name[byte] ^ best[byte]);
+    while (otherbits & (otherbits - 1)) {   // keep only the highest bit
+        otherbits &= otherbits - 1;
+    }
+    otherbits ^= 255;
+    int direction = (1 + (otherbits | (uint8_t) best[byte])) >> 8;
+
+    struct critbit_node *new_node = malloc(sizeof(struct critbit_node));
+    if (new_node == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    new_node->byte = byte;
+    new_node->otherbits = otherbits;
+    new_node->child[1 - direction] = user;
+
+    // It goes above the first node that splits on a later bit.
+    void **where = &trie_root;
+    while (IS_NODE(*where)) {
+        struct critbit_node *node = TO_NODE(*where);
+        if (node->byte > byte || (node->byte == byte && node->otherbits > otherbits)) {
+            break;
+        }
+        where = &node->child[critbit_direction(node, name, len)];
+    }
+    new_node->child[direction] = *where;
+    *where = (char *) new_node + 1;
+}
+
+static void trie_free(void *p) {
+    if (IS_NODE(p)) {
+        struct critbit_node *node = TO_NODE(p);
+        trie_free(node->child[0]);
+        trie_free(node->child[1]);
+        free(node);
+    }
+}
+
+/*
+ * Store the users under p in out, in order, until count reaches max.
+ */
+static void trie_collect(const void *p, const User **out, uint32_t *count, uint32_t max) {
+    while (IS_NODE(p) && *count < max) {
+        const struct critbit_node *node = TO_NODE(p);
+        trie_collect(node->child[0], out, count, max);
+        p = node->child[1];
+    }
+    if (!IS_NODE(p) && *count < max) {
+        out[(*count)++] = p;
+    }
+}
+
+/*
+ * Resize the index to new_size slots and re-add every user in the list
+ * starting at head.
+ */
+static void index_rebuild(const User *head, size_t new_size) {
+    size_t count = 0;
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        count++;
+    }
+    while (count * 4 > new_size * 3) {
+        new_size *= 2;
+    }
+
+    free(index_slots);
+    index_slots = calloc(new_size, sizeof(User *));
+    if (index_slots == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    index_size = new_size;
+    index_used = 0;
+    index_head = head;
+    index_tail = NULL;
+    for (User *curr = (User *)head; curr != NULL; curr = curr->next) {
+        index_slots[index_find(curr->name)] = curr;
+        index_used++;
+        index_tail = curr;
+    }
+}
 
 /*
  * Create a new user with the given name.  Insert it at the tail of the list 
@@ -29,30 +236,53 @@ int create_user(const char *name, User **user_ptr_add) {
         new_user->profile_pic[i] = '\0';
     }
 
-    new_user->first_post = NULL;
     new_user->next = NULL;
-    for (int i = 0; i < MAX_FRIENDS; i++) {
-        new_user->friends[i] = NULL;
-    }
+    new_user->friends = NULL;
+    new_user->nfriends = 0;
+    new_user->cap_friends = 0;
+    new_user->friend_bits = NULL;
+    new_user->friend_words = 0;
+    new_user->profile = NULL;
+    new_user->posts = NULL;
+    new_user->nposts = 0;
+    new_user->cap_posts = 0;
+    new_user->authored = NULL;
+    new_user->nauthored = 0;
+    new_user->cap_authored = 0;
+    new_user->fanned_out = 0;
+    new_user->authored_sorted = 1;
+    new_user->feed = NULL;
+    new_user->feed_start = 0;
+    new_user->feed_len = 0;
 
     // Add user to list
-    User *prev = NULL;
-    User *curr = *user_ptr_add;
-    while (curr != NULL && strcmp(curr->name, name) != 0) {
-        prev = curr;
-        curr = curr->next;
+    if (index_slots == NULL || index_head != *user_ptr_add) {
+        index_rebuild(*user_ptr_add, 1024);
     }
 
-    if (*user_ptr_add == NULL) {       // bug fixed 03/04/2016. Now correct on repeat of 1st name
-        *user_ptr_add = new_user;
-        return 0;
-    } else if (curr != NULL) {
+    size_t slot = index_find(name);
+    if (index_slots[slot] != NULL) {
         free(new_user);
         return 1;
+    }
+
+    new_user->id = index_used;
+    if (*user_ptr_add == NULL) {       // bug fixed 03/04/2016. Now correct on repeat of 1st name
+        *user_ptr_add = new_user;
+        index_head = new_user;
     } else {
-        prev->next = new_user;
-        return 0;
+        index_tail->next = new_user;
+    }
+    index_tail = new_user;
+    index_slots[slot] = new_user;
+    if (trie_head != NULL && trie_head == *user_ptr_add) {
+        trie_insert(new_user);
+    }
+    index_used++;
+    if (index_used * 4 > index_size * 3) { // Keep the load under 3/4
+        index_rebuild(*user_ptr_add, index_size * 2);
     }
+    return 0;
 }
 
 
@@ -64,18 +294,104 @@ int create_user(const char *name, User **user_ptr_add) {
  * to satisfy the prototype without warnings.
  */
 User *find_user(const char *name, const User *head) {
-/*    const User *curr = head;
-    while (curr != NULL && strcmp(name, curr->name) != 0) {
-        curr = curr->next;
+    if (head == NULL) {
+        return NULL;
+    }
+    if (index_slots == NULL || index_head != head) {
+        index_rebuild(head, 1024);
     }
+    return index_slots[index_find(name)];
+}
+
+
+int search_ready(const User *head) {
+    return head == NULL || trie_head == head;
+}
+
+
+/*
+ * Building the tree for a million users takes about half a second, so a
+ * loaded list waits for its first search.  From then on create_user adds
+ * to it.
+ */
+void build_search(const User *head) {
+    if (search_ready(head)) {
+        return;
+    }
+    trie_free(trie_root);
+    trie_root = NULL;
+    for (User *curr = (User *) head; curr != NULL; curr = curr->next) {
+        trie_insert(curr);
+    }
+    trie_head = head;
+}
+
+
+/*
+ * Walk down the path prefix selects, then take its whole subtree if the
+ * name at the end of the path does start with prefix: bits past the
+ * prefix are not looked at on the way, so that name stands for them all.
+ */
+uint32_t search_users(const char *prefix, const User *head, const User **out, uint32_t max) {
+    if (head == NULL) {
+        return 0;
+    }
+    build_search(head);
+    size_t len = strlen(prefix);
+    const void *p = trie_root, *top = trie_root;
+    while (IS_NODE(p)) {
+        const struct critbit_node *node = TO_NODE(p);
+        p = node->child[critbit_direction(node, prefix, len)];
+        if (node->byte < len) {
+            top = p;
+        }
+    }
+    if (strncmp(((const User *) p)->name, prefix, len) != 0) {
+        return 0;
+    }
+    uint32_t count = 0;
+    trie_collect(top, out, &count, max);
+    return count;
+}
+
 
-    return (User *)curr;
-*/
-    while (head != NULL && strcmp(name, head->name) != 0) {
-        head = head->next;
+void render_search(StrBuf *sb, const char *prefix, const User *head, uint32_t limit) {
+    const User **found = malloc(sizeof(User *) * (limit + 1));
+    if (found == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint32_t count = search_users(prefix, head, found, limit + 1);
+    if (count == 0) {
+        sb_printf(sb, "No users start with %s\r\n", prefix);
     }
+    for (uint32_t i = 0; i < count && i < limit; i++) {
+        sb_puts(sb, found[i]->name);
+        sb_append(sb, "\r\n", 2);
+    }
+    if (count > limit) {
+        sb_printf(sb, "(more than %u: give a longer prefix or a larger limit)\r\n", limit);
+    }
+    free(found);
+}
+
+
+/*
+ * Append the usernames of all users in the list starting at curr to sb,
+ * one per line.
+ */
+void render_users(StrBuf *sb, const User *curr) {
+    render_users_upto(sb, curr, SIZE_MAX);
+}
+
 
-    return (User *)head;
+const User *render_users_upto(StrBuf *sb, const User *curr, size_t max) {
+    size_t start = sb->len;
+    for (; curr != NULL && sb->len - start < max; curr = curr->next) {
+        sb_puts(sb, curr->name);
+        sb_append(sb, "\r\n", 2);
+    }
+    return curr;
 }
 
 
@@ -84,49 +400,159 @@ User *find_user(const char *name, const User *head) {
  * Names should be printed to standard output, one per line.
  */
 char *list_users(const User *curr) {
-    const User *head = curr; // save the head of the linked list
-    int total_length = 0;
-    
-    // loop to find total_length
-    while (curr != NULL) {
-        total_length += (strlen(curr->name) + strlen("\r\n"));
-        curr = curr->next;
-    }
-    total_length += strlen("\0");
-    
-    // allocate the space
-    char *buf = malloc(sizeof(char) * (total_length));    
-    if (buf == NULL) {
-        perror("malloc");
-        exit(1);
+    StrBuf sb = STRBUF_INIT;
+    render_users(&sb, curr);
+    return sb_detach(&sb);
+}
+
+
+/*
+ * Forget user's cached profile, since it no longer matches.
+ */
+static void drop_profile(User *user) {
+    free(user->profile);
+    user->profile = NULL;
+}
+
+
+/*
+ * Forget user's feed, since a new friend's older posts are missing from it.
+ */
+static void drop_feed(User *user) {
+    free(user->feed);
+    user->feed = NULL;
+    user->feed_start = 0;
+    user->feed_len = 0;
+}
+
+
+/*
+ * Return the position of the first friend of user whose id is at least
+ * id: where a friend with that id is, or would go.
+ */
+static uint32_t friend_slot(const User *user, uint32_t id) {
+    uint32_t lo = 0, hi = user->nfriends;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (user->friends[mid]->id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/*
+ * Return 1 if user's friend bitset has the bit for id.
+ */
+static int has_friend_bit(const User *user, uint32_t id) {
+    return id / 64 < user->friend_words && (user->friend_bits[id / 64] >> (id % 64) & 1);
+}
+
+
+/*
+ * Return 1 if user1 and user2 are friends, 0 if not.
+ */
+int are_friends(const User *user1, const User *user2) {
+    // Search the shorter list.
+    if (user1->nfriends > user2->nfriends) {
+        const User *tmp = user1;
+        user1 = user2;
+        user2 = tmp;
+    }
+    if (user2->friend_bits != NULL) {
+        return has_friend_bit(user2, user1->id);
     }
+    uint32_t i = friend_slot(user1, user2->id);
+    return i < user1->nfriends && user1->friends[i] == user2;
+}
 
-    curr = head;
-    snprintf(buf, sizeof(curr->name), "%s\r\n", curr->name);
-    // loop again to put everything into buf
-    curr = curr->next;
 
-    while (curr != NULL) {
-        snprintf(buf + strlen(buf), sizeof(curr->name), "%s\r\n", curr->name);
-        curr = curr->next;
+/*
+ * Set the bit for id in user's friend bitset, growing it if needed.
+ */
+static void set_friend_bit(User *user, uint32_t id) {
+    if (id / 64 >= user->friend_words) {
+        // Leave room for the users still to come.
+        uint32_t words = (index_used > id ? index_used : id + 1) / 64 + 1;
+        uint64_t *bits = realloc(user->friend_bits, sizeof(uint64_t) * words);
+        if (bits == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(bits + user->friend_words, 0, sizeof(uint64_t) * (words - user->friend_words));
+        user->friend_bits = bits;
+        user->friend_words = words;
     }
-    
-    return buf;
+    user->friend_bits[id / 64] |= (uint64_t) 1 << (id % 64);
 }
 
 
+/*
+ * Give user a bitset of its friends if it has no bitset and enough
+ * friends: at least BITSET_MIN, and enough that the bitset is no bigger
+ * than the friends array.
+ */
+static void index_bits(User *user) {
+    if (user->friend_bits != NULL || user->nfriends < BITSET_MIN ||
+        user->nfriends < index_used / 64) {
+        return;
+    }
+    for (uint32_t i = 0; i < user->nfriends; i++) {
+        set_friend_bit(user, user->friends[i]->id);
+    }
+}
+
+
+void index_friend_bits(User *head) {
+    for (User *user = head; user != NULL; user = user->next) {
+        index_bits(user);
+    }
+}
+
+
+/*
+ * Insert friend into user's friends at position i, growing the array
+ * if it is full.  An array make_friends did not allocate is copied.
+ */
+static void insert_friend(User *user, uint32_t i, User *friend) {
+    if (user->nfriends >= user->cap_friends) {
+        uint32_t new_cap = user->nfriends < 4 ? 8 : user->nfriends * 2;
+        User **friends = malloc(sizeof(User *) * new_cap);
+        if (friends == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (user->nfriends > 0) {
+            memcpy(friends, user->friends, sizeof(User *) * user->nfriends);
+        }
+        if (user->cap_friends > 0) {
+            free(user->friends);
+        }
+        user->friends = friends;
+        user->cap_friends = new_cap;
+    }
+    memmove(&user->friends[i + 1], &user->friends[i], sizeof(User *) * (user->nfriends - i));
+    user->friends[i] = friend;
+    user->nfriends++;
+    if (user->friend_bits != NULL) {
+        set_friend_bit(user, friend->id);
+    } else {
+        index_bits(user);
+    }
+}
+
 
 /* 
  * Make two users friends with each other.  This is symmetric - a pointer to 
- * each user must be stored in the 'friends' array of the other.
- *
- * New friends must be added in the first empty spot in the 'friends' array.
+ * each user is stored in the 'friends' array of the other, which grows as
+ * needed and is kept in order of id.
  *
  * Return:
  *   - 0 on success.
  *   - 1 if the two users are already friends.
- *   - 2 if the users are not already friends, but at least one already has
- *     MAX_FRIENDS friends.
  *   - 3 if the same user is passed in twice.
  *   - 4 if at least one user does not exist.
  *
@@ -143,28 +569,341 @@ int make_friends(const char *name1, const char *name2, User *head) {
         return 3;
     }
 
-    int i, j;
-    for (i = 0; i < MAX_FRIENDS; i++) {
-        if (user1->friends[i] == NULL) { // Empty spot
-            break;
-        } else if (user1->friends[i] == user2) { // Already friends.
-            return 1;
+    uint32_t i = friend_slot(user1, user2->id);
+    if (i < user1->nfriends && user1->friends[i] == user2) { // Already friends.
+        return 1;
+    }
+
+    insert_friend(user1, i, user2);
+    insert_friend(user2, friend_slot(user2, user1->id), user1);
+    drop_profile(user1);
+    drop_profile(user2);
+    drop_feed(user1);
+    drop_feed(user2);
+    return 0;
+}
+
+
+#define GALLOP_RATIO 32     // How much longer a list must be to gallop through it
+
+/*
+ * Return the position of the first of the n users at list, from lo on,
+ * whose id is at least id.  Steps of doubling length find a range to
+ * binary search, so a near answer is found in a few steps.
+ */
+static uint32_t gallop(User *const *list, uint32_t n, uint32_t lo, uint32_t id) {
+    uint32_t step = 1, hi = lo;
+    while (hi < n && list[hi]->id < id) {
+        lo = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if (hi > n) {
+        hi = n;
+    }
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (list[mid]->id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    for (j = 0; j < MAX_FRIENDS; j++) {
-        if (user2->friends[j] == NULL) { // Empty spot
-            break;
-        } 
+
+/*
+ * As mutual_friends, but out may be NULL to only count them.
+ */
+static uint32_t intersect(const User *user1, const User *user2, const User **out) {
+    // Walk the shorter list.
+    if (user1->nfriends > user2->nfriends) {
+        const User *tmp = user1;
+        user1 = user2;
+        user2 = tmp;
     }
+    User *const *a = user1->friends, *const *b = user2->friends;
+    uint32_t na = user1->nfriends, nb = user2->nfriends, count = 0;
 
-    if (i == MAX_FRIENDS || j == MAX_FRIENDS) { // Too many friends.
-        return 2;
+    if (user2->friend_bits != NULL) {
+        for (uint32_t i = 0; i < na; i++) {
+            if (has_friend_bit(user2, a[i]->id)) {
+                if (out != NULL) {
+                    out[count] = a[i];
+                }
+                count++;
+            }
+        }
+    } else if (na > 0 && nb / na >= GALLOP_RATIO) {
+        uint32_t j = 0;
+        for (uint32_t i = 0; i < na && j < nb; i++) {
+            j = gallop(b, nb, j, a[i]->id);
+            if (j < nb && b[j] == a[i]) {
+                if (out != NULL) {
+                    out[count] = a[i];
+                }
+                count++;
+                j++;
+            }
+        }
+    } else {
+        uint32_t i = 0, j = 0;
+        while (i < na && j < nb) {
+            uint32_t id_a = a[i]->id, id_b = b[j]->id;
+            if (id_a == id_b) {
+                if (out != NULL) {
+                    out[count] = a[i];
+                }
+                count++;
+            }
+            i += id_a <= id_b;
+            j += id_b <= id_a;
+        }
     }
+    return count;
+}
 
-    user1->friends[i] = user2;
-    user2->friends[j] = user1;
-    return 0;
+
+uint32_t mutual_friends(const User *user1, const User *user2, const User **out) {
+    return intersect(user1, user2, out);
+}
+
+
+void render_mutual(StrBuf *sb, const User *user1, const User *user2) {
+    uint32_t n = user1->nfriends < user2->nfriends ? user1->nfriends : user2->nfriends;
+    const User **mutual = malloc(sizeof(User *) * (n ? n : 1));
+    if (mutual == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint32_t count = mutual_friends(user1, user2, mutual);
+    sb_printf(sb, "Mutual friends of %s and %s: %u\r\n", user1->name, user2->name, count);
+    for (uint32_t i = 0; i < count; i++) {
+        sb_puts(sb, mutual[i]->name);
+        sb_append(sb, "\r\n", 2);
+    }
+    free(mutual);
+}
+
+
+#define MAX_CANDIDATES (1 << 20)    // Most friends of friends suggest_friends looks at
+
+static int compare_id(const void *a, const void *b) {
+    uint32_t x = (*(User *const *) a)->id, y = (*(User *const *) b)->id;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Return 1 if suggestion a should come before b.
+ */
+static int better_suggestion(const Suggestion *a, const Suggestion *b) {
+    return a->mutual > b->mutual || (a->mutual == b->mutual && a->user->id < b->user->id);
+}
+
+/*
+ * Friends of friends are gathered into one array and sorted by id, so a
+ * candidate's run of copies counts the walked friends it shares with
+ * user; each hub it is a friend of adds one more.  A user with a bitset
+ * has too many hubs for that, so its candidates are scored by
+ * intersecting their friends with its bitset instead.
+ */
+uint32_t suggest_friends(const User *user, Suggestion *out, uint32_t n) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < user->nfriends; i++) {
+        if (user->friends[i]->nfriends <= SUGGEST_WALK_MAX) {
+            total += user->friends[i]->nfriends;
+        }
+    }
+    if (total > MAX_CANDIDATES) {
+        total = MAX_CANDIDATES;
+    }
+    const User **candidates = malloc(sizeof(User *) * (total ? total : 1));
+    const User **hubs = malloc(sizeof(User *) * (user->nfriends ? user->nfriends : 1));
+    if (candidates == NULL || hubs == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    uint32_t ncandidates = 0, nhubs = 0;
+    for (uint32_t i = 0; i < user->nfriends; i++) {
+        const User *friend = user->friends[i];
+        if (friend->nfriends > SUGGEST_WALK_MAX) {
+            hubs[nhubs++] = friend;
+        } else if (total - ncandidates >= friend->nfriends) {
+            memcpy(candidates + ncandidates, friend->friends, sizeof(User *) * friend->nfriends);
+            ncandidates += friend->nfriends;
+        }
+    }
+    qsort(candidates, ncandidates, sizeof(User *), compare_id);
+
+    // Keep the best n in out, best first.
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < ncandidates;) {
+        Suggestion s = {candidates[i], 0};
+        while (i < ncandidates && candidates[i] == s.user) {
+            s.mutual++;
+            i++;
+        }
+        if (s.user == user || are_friends(user, s.user)) {
+            continue;
+        }
+        if (user->friend_bits != NULL) {
+            s.mutual = intersect(user, s.user, NULL);
+        } else {
+            for (uint32_t j = 0; j < nhubs; j++) {
+                s.mutual += are_friends(hubs[j], s.user);
+            }
+        }
+        if (count == n && (n == 0 || !better_suggestion(&s, &out[n - 1]))) {
+            continue;
+        }
+        uint32_t j = count < n ? count++ : n - 1;
+        for (; j > 0 && better_suggestion(&s, &out[j - 1]); j--) {
+            out[j] = out[j - 1];
+        }
+        out[j] = s;
+    }
+    free(candidates);
+    free(hubs);
+    return count;
+}
+
+
+void render_suggestions(StrBuf *sb, const User *user, uint32_t n) {
+    Suggestion suggestions[MAX_SUGGEST];
+    uint32_t count = suggest_friends(user, suggestions, n < MAX_SUGGEST ? n : MAX_SUGGEST);
+    if (count == 0) {
+        sb_puts(sb, "No suggestions\r\n");
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        sb_printf(sb, "%s (%u mutual friend%s)\r\n", suggestions[i].user->name,
+                  suggestions[i].mutual, suggestions[i].mutual == 1 ? "" : "s");
+    }
+}
+
+
+#define DIVIDER "------------------------------------------\r\n"
+
+/*
+ * Append the name and friends sections of a profile to sb.
+ */
+static void render_head(StrBuf *sb, const User *user) {
+    sb_printf(sb, "Name: %s\r\n\r\n" DIVIDER "Friends:\r\n", user->name);
+    for (uint32_t i = 0; i < user->nfriends; i++) {
+        sb_puts(sb, user->friends[i]->name);
+        sb_append(sb, "\r\n", 2);
+    }
+    sb_puts(sb, DIVIDER);
+}
+
+
+/*
+ * Append one post to sb, naming the user it was posted to if show_target.
+ */
+static void render_post(StrBuf *sb, const Post *post, int show_target) {
+    sb_puts(sb, "From: ");
+    sb_puts(sb, post->author->name);
+    if (show_target) {
+        sb_puts(sb, "\r\nTo: ");
+        sb_puts(sb, post->target->name);
+    }
+    sb_puts(sb, "\r\nDate: ");
+    sb_puts(sb, post->date_text);
+    sb_append(sb, "\r\n", 2);
+    sb_puts(sb, post->contents);
+    sb_append(sb, "\r\n", 2);
+}
+
+
+/*
+ * Append the posts of user from offset (counting from the newest) up to
+ * offset + limit to sb.  The index makes finding the first one O(1).
+ */
+static void render_post_range(StrBuf *sb, const User *user, uint32_t offset, uint32_t limit) {
+    for (uint32_t i = offset; i < user->nposts && i - offset < limit; i++) {
+        if (i != offset) {
+            sb_puts(sb, "\r\n===\r\n\r\n");
+        }
+        render_post(sb, user->posts[user->nposts - 1 - i], 0);
+    }
+}
+
+
+/*
+ * Append the "Posts a-b of n:" line for a page to sb.
+ */
+static void render_page_title(StrBuf *sb, const User *user, uint32_t offset, uint32_t limit) {
+    uint32_t end = offset < user->nposts ? user->nposts - offset : 0;
+    if (end > limit) {
+        end = limit;
+    }
+    end += offset;
+    if (end > offset) {
+        sb_printf(sb, "Posts %u-%u of %u:\r\n", offset + 1, end, user->nposts);
+    } else {
+        sb_printf(sb, "Posts: none past %u of %u\r\n", offset, user->nposts);
+    }
+}
+
+
+/*
+ * Append a user profile to sb.  The whole profile is written in one pass.
+ */
+void render_user(StrBuf *sb, const User *user) {
+    render_head(sb, user);
+    sb_puts(sb, "Posts:\r\n");
+    render_post_range(sb, user, 0, user->nposts);
+    sb_puts(sb, DIVIDER);
+}
+
+
+void render_user_page(StrBuf *sb, const User *user, uint32_t offset, uint32_t limit) {
+    render_head(sb, user);
+    render_page_title(sb, user, offset, limit);
+    render_post_range(sb, user, offset, limit);
+    sb_puts(sb, DIVIDER);
+}
+
+
+void render_posts(StrBuf *sb, const User *user, uint32_t offset, uint32_t limit) {
+    render_page_title(sb, user, offset, limit);
+    render_post_range(sb, user, offset, limit);
+    sb_puts(sb, DIVIDER);
+}
+
+
+/*
+ * Return user's rendered profile, rendering and caching it first if
+ * needed.  Readers may race to fill the cache; the first to publish its
+ * copy wins and the others use that one.
+ */
+const Profile *get_profile(User *user, int *hit) {
+    Profile *profile = __atomic_load_n(&user->profile, __ATOMIC_ACQUIRE);
+    if (profile != NULL) {
+        *hit = 1;
+        return profile;
+    }
+    *hit = 0;
+
+    StrBuf sb = STRBUF_INIT;
+    render_user(&sb, user);
+    profile = malloc(sizeof(Profile) + sb.len);
+    if (profile == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    profile->len = sb.len;
+    memcpy(profile->data, sb.data, sb.len);
+    sb_free(&sb);
+
+    Profile *expected = NULL;
+    if (!__atomic_compare_exchange_n(&user->profile, &expected, profile, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(profile);
+        profile = expected;
+    }
+    return profile;
 }
 
 
@@ -172,83 +911,54 @@ int make_friends(const char *name1, const char *name2, User *head) {
  * Print a user profile.
  * For an example of the required output format, see the example output
  * linked from the handout.
- * Return:
- *   - 0 on success.
- *   - 1 if the user is NULL.
+ * Return the profile in a new buffer, or NULL if the user is NULL.
  */
 char *print_user(const User *user) {
     if (user == NULL) {
         return NULL;
     }
-    
-    int total_length = 0;
-    
-    // find total_length
-    total_length += (strlen("Name: \r\n\r\n") + 1);
-    total_length += (strlen(user->name) + 1);
-    total_length += (strlen("------------------------------------------\r\n") + 1);
-    
-    total_length += (strlen("Friends:\r\n") + 1);
-    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
-        total_length += (strlen("\r\n") + 1);
-        total_length += (strlen(user->friends[i]->name) + 1);
-    }
-    total_length += (strlen("------------------------------------------\r\n") + 1);
-    
-    total_length += (strlen("Posts:\r\n") + 1);
-    const Post *curr = user->first_post;
-    while (curr != NULL) {
-        total_length += (strlen("From: \r\n") + 1);
-		total_length += (strlen(curr->author) + 1);
-		total_length += (strlen("Date: \r\n") + 1);
-		total_length += (strlen(asctime(localtime(curr->date))) + 1);
-		total_length += (strlen("\r\n") + 1);
-		total_length += (strlen(curr->contents) + 1);
-        curr = curr->next;
-        if (curr != NULL) {
-            total_length += (strlen("\r\n===\r\n\r\n") + 1);
-        }
-    }
-    total_length += (strlen("------------------------------------------\r\n") + 1);
-    
-    // allocate the space
-    char *buf = malloc(sizeof(char) * (total_length));    
-    if (buf == NULL) {
-        perror("malloc");
-        exit(1);
+    StrBuf sb = STRBUF_INIT;
+    render_user(&sb, user);
+    return sb_detach(&sb);
+}
+
+
+/*
+ * The arena posts are allocated from: chunks that are filled front to
+ * back and never freed, so a post costs no malloc of its own and sits
+ * next to its contents.
+ */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
+#define ARENA_CHUNK (1 << 20)
+
+static struct arena_chunk *post_arena = NULL;
+
+/*
+ * Return size bytes from the post arena, aligned for a Post.
+ */
+static void *arena_alloc(size_t size) {
+    size = (size + __alignof__(Post) - 1) & ~(__alignof__(Post) - 1);
+    if (post_arena == NULL || post_arena->cap - post_arena->used < size) {
+        size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + cap);
+        if (chunk == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        chunk->next = post_arena;
+        chunk->used = 0;
+        chunk->cap = cap;
+        post_arena = chunk;
     }
-    
-    // put name into buf
-    snprintf(buf, sizeof(user->name), "Name: %s\r\n\r\n", user->name);
-    snprintf(buf + strlen(buf), sizeof("------------------------------------------\r\n"), 
-    "------------------------------------------\r\n");
-    
-    // put friend list into buf
-    snprintf(buf + strlen(buf), sizeof("Friends:\r\n"), "Friends:\r\n");
-    for (int j = 0; j < MAX_FRIENDS && user->friends[j] != NULL; j++) {
-        snprintf(buf + strlen(buf), sizeof(user->friends[j]->name), 
-        "%s\r\n", user->friends[j]->name);
-    }
-    snprintf(buf + strlen(buf), sizeof("------------------------------------------\r\n"), 
-    "------------------------------------------\r\n");
-    
-    // put post list into buf
-    snprintf(buf + strlen(buf), sizeof("Posts:\r\n"), "Posts:\r\n");
-    const Post *curr2 = user->first_post;
-    while (curr2 != NULL) {
-		snprintf(buf + strlen(buf), sizeof(curr2->author), "From: %s\r\n", curr2->author);
-		sprintf(buf + strlen(buf), "Date: %s\r\n", asctime(localtime(curr2->date)));
-		sprintf(buf + strlen(buf), "%s\r\n", curr2->contents);
-        curr2 = curr2->next;
-        if (curr2 != NULL) {
-            snprintf(buf + strlen(buf), sizeof("\r\n===\r\n\r\n"), "\r\n===\r\n\r\n");
-        }
-    }
-    // 44
-    snprintf(buf + strlen(buf), sizeof("------------------------------------------\r\n"), 
-    "------------------------------------------\r\n");
-    
-    return buf;
+    void *p = post_arena->data + post_arena->used;
+    post_arena->used += size;
+    return p;
 }
 
 
@@ -256,52 +966,344 @@ char *print_user(const User *user) {
  * Make a new post from 'author' to the 'target' user,
  * containing the given contents, IF the users are friends.
  *
- * Insert the new post at the *front* of the user's list of posts.
+ * Add the new post to the end of the user's posts (newest last).
  *
  * Use the 'time' function to store the current time.
  *
- * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * 'contents' is copied; the caller still owns it.
  *
  * Return:
  *   - 0 on success
  *   - 1 if users exist but are not friends
  *   - 2 if either User pointer is NULL
  */
-int make_post(const User *author, User *target, char *contents) {
+int make_post(User *author, User *target, const char *contents) {
+    return make_post_at(author, target, contents, strlen(contents), time(NULL));
+}
+
+
+/*
+ * Add post to the end of a list of *n posts, growing it if it is full.
+ * A list make_post did not allocate (*cap is 0) is copied.
+ */
+static void append_post(Post ***list, uint32_t *n, uint32_t *cap, Post *post) {
+    if (*n >= *cap) {
+        uint32_t new_cap = *n < 4 ? 8 : *n * 2;
+        Post **posts = malloc(sizeof(Post *) * new_cap);
+        if (posts == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (*n > 0) {
+            memcpy(posts, *list, sizeof(Post *) * *n);
+        }
+        if (*cap > 0) {
+            free(*list);
+        }
+        *list = posts;
+        *cap = new_cap;
+    }
+    (*list)[(*n)++] = post;
+}
+
+
+/*
+ * Authors some of whose posts were not fanned out, in no order.  A feed
+ * checks each of them, so there should be few: FANOUT_LIMIT sets that.
+ */
+static User **pulled_authors = NULL;
+static uint32_t npulled_authors = 0;
+static uint32_t cap_pulled_authors = 0;
+
+static void add_pulled_author(User *author) {
+    if (npulled_authors >= cap_pulled_authors) {
+        cap_pulled_authors = cap_pulled_authors < 4 ? 8 : cap_pulled_authors * 2;
+        pulled_authors = realloc(pulled_authors, sizeof(User *) * cap_pulled_authors);
+        if (pulled_authors == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    pulled_authors[npulled_authors++] = author;
+}
+
+
+/*
+ * Add post to the newest end of user's feed, dropping the oldest if the
+ * feed is full.
+ */
+static void feed_push(User *user, Post *post) {
+    if (user->feed_len < FEED_LEN) {
+        user->feed[(user->feed_start + user->feed_len++) % FEED_LEN] = post;
+    } else {
+        user->feed[user->feed_start] = post;
+        user->feed_start = (user->feed_start + 1) % FEED_LEN;
+    }
+}
+
+
+/*
+ * As make_post, but the post is the len bytes at contents and is dated
+ * 'date' instead of now.
+ */
+int make_post_at(User *author, User *target, const char *contents, size_t len,
+                 time_t date) {
     if (target == NULL || author == NULL) {
         return 2;
     }
 
-    int friends = 0;
-    for (int i = 0; i < MAX_FRIENDS && target->friends[i] != NULL; i++) {
-        if (strcmp(target->friends[i]->name, author->name) == 0) {
-            friends = 1;
-            break;
+    if (!are_friends(author, target)) {
+        return 1;
+    }
+
+    // The post, its date as text and its contents in one piece
+    Post *new_post = arena_alloc(sizeof(Post) + DATE_TEXT + len + 1);
+    char *date_text = (char *) (new_post + 1);
+    char *copy = date_text + DATE_TEXT;
+    format_date(date, date_text);
+    memcpy(copy, contents, len);
+    copy[len] = '\0';
+    new_post->author = author;
+    new_post->target = target;
+    new_post->date = date;
+    new_post->date_text = date_text;
+    new_post->contents = copy;
+    append_post(&target->posts, &target->nposts, &target->cap_posts, new_post);
+    drop_profile(target);
+
+    // Authored posts are fanned out up to the moment the author has too
+    // many friends, and never after, since friends are never lost.
+    append_post(&author->authored, &author->nauthored, &author->cap_authored, new_post);
+    if (author->nfriends <= FANOUT_LIMIT) {
+        author->fanned_out++;
+        for (uint32_t i = 0; i < author->nfriends; i++) {
+            if (author->friends[i]->feed != NULL) {
+                feed_push(author->friends[i], new_post);
+            }
         }
+    } else if (author->nauthored - author->fanned_out == 1) {
+        add_pulled_author(author);
     }
 
-    if (friends == 0) {
-        return 1;
+    return 0;
+}
+
+
+/*
+ * A run of posts, oldest first, being merged from its newest end.
+ */
+struct run {
+    Post *const *posts;
+    uint32_t left;          // posts[left - 1] is the newest not yet taken
+};
+
+static int run_newer(const struct run *a, const struct run *b) {
+    return a->posts[a->left - 1]->date > b->posts[b->left - 1]->date;
+}
+
+/*
+ * Restore the heap order of runs below position i, the newest head first.
+ */
+static void sift_down(struct run *runs, uint32_t n, uint32_t i) {
+    for (;;) {
+        uint32_t newest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && run_newer(&runs[l], &runs[newest])) {
+            newest = l;
+        }
+        if (r < n && run_newer(&runs[r], &runs[newest])) {
+            newest = r;
+        }
+        if (newest == i) {
+            return;
+        }
+        struct run tmp = runs[i];
+        runs[i] = runs[newest];
+        runs[newest] = tmp;
+        i = newest;
+    }
+}
+
+/*
+ * Merge the newest max posts of the n non-empty runs into out, newest
+ * first.  The runs are used up.  Return how many were merged.
+ */
+static uint32_t merge_newest(struct run *runs, uint32_t n, Post **out, uint32_t max) {
+    uint32_t count = 0;
+    for (uint32_t i = n / 2; i-- > 0;) {
+        sift_down(runs, n, i);
     }
+    while (n > 0 && count < max) {
+        out[count++] = runs[0].posts[--runs[0].left];
+        if (runs[0].left == 0) {
+            runs[0] = runs[--n];
+        }
+        sift_down(runs, n, 0);
+    }
+    return count;
+}
+
 
-    // Create post
-    Post *new_post = malloc(sizeof(Post));
-    if (new_post == NULL) {
+/*
+ * Merge the newest max posts by user's friends into out, newest first:
+ * those in its feed and those by authors that were not fanned out.
+ * Return how many there are.
+ */
+static uint32_t collect_feed(const User *user, Post **out, uint32_t max) {
+    Post *ring[FEED_LEN];
+    uint32_t nruns = 0;
+    struct run *runs = malloc(sizeof(struct run) * (1 + npulled_authors));
+    if (runs == NULL) {
         perror("malloc");
         exit(1);
     }
-    strncpy(new_post->author, author->name, MAX_NAME);
-    new_post->contents = contents;
-    new_post->date = malloc(sizeof(time_t));
-    if (new_post->date == NULL) {
+
+    for (uint32_t i = 0; i < user->feed_len; i++) {
+        ring[i] = user->feed[(user->feed_start + i) % FEED_LEN];
+    }
+    if (user->feed_len > 0) {
+        runs[nruns++] = (struct run) {ring, user->feed_len};
+    }
+    for (uint32_t i = 0; i < npulled_authors; i++) {
+        const User *author = pulled_authors[i];
+        if (are_friends(author, user)) {
+            runs[nruns++] = (struct run) {author->authored + author->fanned_out,
+                                          author->nauthored - author->fanned_out};
+        }
+    }
+
+    uint32_t count = merge_newest(runs, nruns, out, max);
+    free(runs);
+    return count;
+}
+
+
+void render_feed(StrBuf *sb, const User *user, uint32_t limit) {
+    Post *posts[FEED_LEN];
+    uint32_t count = collect_feed(user, posts, limit < FEED_LEN ? limit : FEED_LEN);
+
+    sb_printf(sb, "Feed for %s:\r\n", user->name);
+    for (uint32_t i = 0; i < count; i++) {
+        if (i != 0) {
+            sb_puts(sb, "\r\n===\r\n\r\n");
+        }
+        render_post(sb, posts[i], 1);
+    }
+    sb_puts(sb, DIVIDER);
+}
+
+
+int feed_ready(const User *user) {
+    return user->feed != NULL;
+}
+
+
+static int compare_post_date(const void *a, const void *b) {
+    const Post *p = *(Post *const *) a, *q = *(Post *const *) b;
+    if (p->date != q->date) {
+        return p->date < q->date ? -1 : 1;
+    }
+    return p < q ? -1 : p > q;   // the order they were saved in
+}
+
+/*
+ * Put user's authored posts in date order, if index_authors left them
+ * out of it.
+ */
+static void sort_authored(User *user) {
+    if (!user->authored_sorted) {
+        qsort(user->authored, user->nauthored, sizeof(Post *), compare_post_date);
+        user->authored_sorted = 1;
+    }
+}
+
+
+/*
+ * Build user's feed by merging its friends' fanned out posts once; from
+ * then on make_post keeps it up to date.
+ */
+void build_feed(User *user) {
+    Post *newest[FEED_LEN];
+
+    if (user->feed != NULL) {
+        return;
+    }
+    uint32_t nruns = 0;
+    struct run *runs = malloc(sizeof(struct run) * (user->nfriends + 1));
+    if (runs == NULL) {
         perror("malloc");
         exit(1);
     }
-    time(new_post->date);
-    new_post->next = target->first_post;
-    target->first_post = new_post;
+    for (uint32_t i = 0; i < user->nfriends; i++) {
+        User *friend = user->friends[i];
+        if (friend->fanned_out > 0) {
+            sort_authored(friend);
+            runs[nruns++] = (struct run) {friend->authored, friend->fanned_out};
+        }
+    }
+    uint32_t count = merge_newest(runs, nruns, newest, FEED_LEN);
+    free(runs);
 
-    return 0;
+    user->feed = malloc(sizeof(Post *) * FEED_LEN);
+    if (user->feed == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        user->feed[i] = newest[count - 1 - i];
+    }
+    user->feed_start = 0;
+    user->feed_len = count;
 }
 
+
+/*
+ * All the authored lists share one array, like the friends arrays of a
+ * loaded snapshot.  Sorting them all by date would add a third to the
+ * time a snapshot takes to load, so only the lists of authors with too
+ * many friends, which feeds read as they are, are sorted now; the rest
+ * wait for build_feed.  Posts that were fanned out before are in no
+ * feed now, so such an author can have all of its posts read instead.
+ */
+void index_authors(User *head) {
+    uint64_t total = 0;
+    for (User *user = head; user != NULL; user = user->next) {
+        total += user->nposts;
+    }
+    if (total == 0) {
+        return;
+    }
+    Post **authored = malloc(sizeof(Post *) * total);
+    if (authored == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Count each author's posts, then give each a slice of the array.
+    for (User *user = head; user != NULL; user = user->next) {
+        for (uint32_t i = 0; i < user->nposts; i++) {
+            ((User *) user->posts[i]->author)->nauthored++;
+        }
+    }
+    uint64_t used = 0;
+    for (User *user = head; user != NULL; user = user->next) {
+        user->authored = authored + used;
+        used += user->nauthored;
+        user->nauthored = 0;
+        user->authored_sorted = 0;
+    }
+    for (User *user = head; user != NULL; user = user->next) {
+        for (uint32_t i = 0; i < user->nposts; i++) {
+            User *author = (User *) user->posts[i]->author;
+            author->authored[author->nauthored++] = user->posts[i];
+        }
+    }
+
+    for (User *user = head; user != NULL; user = user->next) {
+        if (user->nfriends <= FANOUT_LIMIT) {
+            user->fanned_out = user->nauthored;
+        } else if (user->nauthored > 0) {
+            sort_authored(user);
+            add_pulled_author(user);
+        }
+    }
+}
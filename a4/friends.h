@@ -1,23 +1,78 @@
+#include <stdint.h>
 #include <time.h>
+#include "strbuf.h"
 
 #define MAX_NAME 32     // Max username and profile_pic filename lengths
-#define MAX_FRIENDS 10  // Max number of friends a user can have
+#define DATE_TEXT 26    // Room for a date in asctime() form
+#define FEED_LEN 50     // Newest posts kept in each user's feed
+#define FANOUT_LIMIT 1000   // Posts by users with more friends are not copied into feeds
+#define BITSET_MIN 1024     // Fewest friends for which a user also keeps a bitset of them
+#define SUGGEST_WALK_MAX 1000   // Friends with more friends are not walked by suggest_friends
+#define MAX_SUGGEST 100     // Most suggestions asked for at once
 
 typedef struct user {
     char name[MAX_NAME];
     char profile_pic[MAX_NAME];  // This is a *filename*, not the file contents.
-    struct post *first_post;
-    struct user *friends[MAX_FRIENDS];
+    struct user **friends;  // sorted by id, so membership is a binary search
+    uint32_t nfriends;
+    uint32_t cap_friends;   // 0 if friends was not malloc'd by make_friends
+    uint32_t id;            // position in the list, counting from 0
+    uint64_t *friend_bits;  // bit i set if user i is a friend, or NULL; see BITSET_MIN
+    uint32_t friend_words;  // 64-bit words in friend_bits
+    struct profile *profile;    // cached render_user() output, or NULL
+    struct post **posts;    // every post to this user, oldest first
+    uint32_t nposts;
+    uint32_t cap_posts;     // 0 if posts was not malloc'd by make_post
+    struct post **authored; // every post by this user, oldest first
+    uint32_t nauthored;
+    uint32_t cap_authored;  // 0 if authored was not malloc'd by make_post
+    uint32_t fanned_out;    // how many of authored were pushed into friends' feeds
+    uint32_t authored_sorted;   // 0 if authored may be out of date order; see index_authors
+    struct post **feed;     // ring of FEED_LEN posts by friends, or NULL if not built
+    uint32_t feed_start;    // position of the oldest post in feed
+    uint32_t feed_len;
     struct user *next;
 } User;
 
+/*
+ * A rendered profile.  Never changed once made: a change to the user
+ * replaces it.
+ */
+typedef struct profile {
+    size_t len;
+    char data[];
+} Profile;
+
+/*
+ * A user suggested as a friend, and how many friends it shares with the
+ * user it was suggested to.
+ */
+typedef struct suggestion {
+    const struct user *user;
+    uint32_t mutual;
+} Suggestion;
+
+/*
+ * Posts are never freed.  make_post() carves each one, with its date as
+ * text and a copy of its contents right after it, out of a shared
+ * append-only arena.  The date is formatted once, when the post is made,
+ * so showing a post converts no times.
+ */
 typedef struct post {
-    char author[MAX_NAME];
-    char *contents;
-    time_t *date;
-    struct post *next;
+    const struct user *author;
+    const struct user *target;
+    time_t date;
+    const char *date_text;  // asctime() form of date, in local time, with its '\n'
+    const char *contents;
 } Post;
 
+/*
+ * None of these functions lock anything.  A program sharing one list of
+ * users between threads must hold a write lock around create_user,
+ * make_friends, make_post, build_feed and build_search, and at least a
+ * read lock around the rest.  get_profile() may be called by several
+ * readers at once.
+ */
 
 /*
  * Create a new user with the given name.  Insert it at the tail of the list
@@ -42,25 +97,106 @@ int create_user(const char *name, User **user_ptr_add);
 User *find_user(const char *name, const User *head);
 
 
+/*
+ * Store in out up to max users of the list starting with head whose names
+ * start with prefix, in order of name, and return how many were stored.
+ * The names are kept in a crit-bit tree, so this costs time in the length
+ * of the prefix and the number stored, not the number of users.
+ *
+ * The tree is built by the first search of a list, which changes it: a
+ * program sharing the list between threads must call build_search under
+ * the write lock first.
+ */
+uint32_t search_users(const char *prefix, const User *head, const User **out, uint32_t max);
+
+/*
+ * Return 1 if the list starting at head can be searched without
+ * building its tree, 0 if not.
+ */
+int search_ready(const User *head);
+
+/*
+ * Build the tree of the names in the list starting at head, if it is not
+ * built.
+ */
+void build_search(const User *head);
+
+/*
+ * As search_users, but list up to limit names in sb, and say so if
+ * there are more.
+ */
+void render_search(StrBuf *sb, const char *prefix, const User *head, uint32_t limit);
+
+
+/*
+ * Return 1 if user1 and user2 are friends, 0 if not.
+ */
+int are_friends(const User *user1, const User *user2);
+
+
+/*
+ * Store the friends user1 and user2 have in common in out, in order of
+ * id, and return how many there are.  out must have room for the smaller
+ * number of friends.
+ *
+ * Friends arrays are sorted by id, so lists of similar length are merged;
+ * when one is much longer, each friend of the shorter is found in it by
+ * galloping (exponential then binary search), and when the longer user has
+ * a bitset, by looking up its bit.
+ */
+uint32_t mutual_friends(const User *user1, const User *user2, const User **out);
+
+/*
+ * As mutual_friends, but list the names under a count in sb.
+ */
+void render_mutual(StrBuf *sb, const User *user1, const User *user2);
+
+/*
+ * Store in out up to n users who are not yet friends of user, with the
+ * most friends in common with it first (ties by id), and return how many
+ * were stored.
+ *
+ * Candidates are the friends of user's friends.  Friends with more than
+ * SUGGEST_WALK_MAX friends (hubs) are not walked: they would bring in
+ * more candidates than can be scored, each sharing just the hub.  They
+ * still count as mutual friends of the candidates found through others.
+ */
+uint32_t suggest_friends(const User *user, Suggestion *out, uint32_t n);
+
+/*
+ * As suggest_friends, but list the suggestions in sb.
+ */
+void render_suggestions(StrBuf *sb, const User *user, uint32_t n);
+
 /*
  * Print the usernames of all users in the list starting at curr.
  * Names should be printed to standard output, one per line.
  */
 char *list_users(const User *curr);
 
+/*
+ * As list_users, but append the names to sb.
+ */
+void render_users(StrBuf *sb, const User *curr);
+
+/*
+ * As render_users, but stop once at least max bytes have been appended.
+ * Return the first user not appended, or NULL if there are none left.
+ * Users are only ever added at the tail, so the result stays valid and
+ * listing can carry on from it later.
+ */
+const User *render_users_upto(StrBuf *sb, const User *curr, size_t max);
+
 
 
 /*
  * Make two users friends with each other.  This is symmetric - a pointer to
- * each user must be stored in the 'friends' array of the other.
- *
- * New friends must be added in the first empty spot in the 'friends' array.
+ * each user is stored in the 'friends' array of the other, which grows as
+ * needed and is kept in order of id.
  *
  * Return:
  *   - 0 on success.
  *   - 1 if the two users are already friends.
- *   - 2 if the users are not already friends, but at least one already has
- *     MAX_FRIENDS friends.
  *   - 3 if the same user is passed in twice.
  *   - 4 if at least one user does not exist.
  *
@@ -74,29 +210,101 @@ int make_friends(const char *name1, const char *name2, User *head);
  * Print a user profile.
  * For an example of the required output format, see the example output
  * linked from the handout.
- * Return:
- *   - 0 on success.
- *   - 1 if the user is NULL.
+ * Return the profile in a new buffer, or NULL if the user is NULL.
  */
 char *print_user(const User *user);
 
+/*
+ * As print_user, but append the profile to sb.  user must not be NULL.
+ */
+void render_user(StrBuf *sb, const User *user);
+
+/*
+ * As render_user, but show only up to limit posts, skipping the offset
+ * newest ones, under a "Posts a-b of n:" line.
+ */
+void render_user_page(StrBuf *sb, const User *user, uint32_t offset, uint32_t limit);
+
+/*
+ * Append just a page of user's posts to sb, as render_user_page shows
+ * them.
+ */
+void render_posts(StrBuf *sb, const User *user, uint32_t offset, uint32_t limit);
+
+/*
+ * Return user's rendered profile, rendering and caching it first if the
+ * user changed since it was last asked for.  Set *hit to 1 if it was
+ * cached, 0 if not.  The result stays valid until the user next changes
+ * (i.e. while the caller holds its read lock).
+ */
+const Profile *get_profile(User *user, int *hit);
+
 
 /*
  * Make a new post from 'author' to the 'target' user,
  * containing the given contents, IF the users are friends.
  *
- * Insert the new post at the *front* of the user's list of posts.
+ * Add the new post to the end of the user's posts (newest last).
  *
  * Use the 'time' function to store the current time.
  *
- * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * 'contents' is copied; the caller still owns it.
  *
  * Return:
  *   - 0 on success
  *   - 1 if users exist but are not friends
  *   - 2 if either User pointer is NULL
  */
-int make_post(const User *author, User *target, char *contents);
+int make_post(User *author, User *target, const char *contents);
+
+
+/*
+ * As make_post, but the post is the len bytes at contents (which need
+ * not end in '\0') and is dated 'date' instead of now.  Used to restore
+ * saved posts.
+ */
+int make_post_at(User *author, User *target, const char *contents, size_t len,
+                 time_t date);
+
+
+/*
+ * Append the newest posts (up to limit, at most FEED_LEN) by any of
+ * user's friends to sb, newest first.
+ *
+ * A post is pushed into the feed of each of its author's friends when it
+ * is made (fan-out on write), so showing a feed reads one short ring
+ * whatever the number of posts.  Authors with more than FANOUT_LIMIT
+ * friends are not pushed; their posts are merged in here from their own
+ * lists instead (fan-out on read).
+ *
+ * user's feed must be built: see build_feed.
+ */
+void render_feed(StrBuf *sb, const User *user, uint32_t limit);
+
+/*
+ * Return 1 if user's feed is built, 0 if not.
+ */
+int feed_ready(const User *user);
+
+/*
+ * Build user's feed from its friends' posts, if it is not built.  Feeds
+ * are built only once asked for, and again after the user makes a new
+ * friend, so this costs time in the number of friends.
+ */
+void build_feed(User *user);
+
+/*
+ * Fill in each user's list of the posts it wrote from the posts to every
+ * user in the list starting at head.  Used after loading posts some other
+ * way than make_post.  No user may have authored posts yet.
+ */
+void index_authors(User *head);
+
+/*
+ * Give each user in the list starting at head that has enough friends a
+ * bitset of them.  Used after filling friends arrays some other way than
+ * make_friends.
+ */
+void index_friend_bits(User *head);
 
 
@@ -1,170 +1,1056 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include "friends.h"
+#include "persist.h"
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
-#define MAX_NAME 32 
+#define MAX_NAME 32
 #define INPUT_BUFFER_SIZE 256
 #define INPUT_ARG_MAX_NUM 12
 #define DELIM " \n"
+#define MAX_EVENTS 256  // Events handled per epoll_wait() wakeup
+#define MAX_LINE 65536  // Longest command line a client may send
+#define OUT_CHUNK 4096  // Smallest output queue chunk; small replies share one
+#define IOV_BATCH 64    // Chunks handed to each writev() call
+#define DEFAULT_HIGH_WATER (1 << 20)  // Queued bytes allowed per client
+#define MIN_SESSION_BUCKETS 1024
+#define MAX_REACTORS 64
+#define DEFAULT_SNAPSHOT_BYTES (64 << 20)  // Log size that triggers a snapshot
+#define MAX_KEPT_REPLY (1 << 20)  // Largest reply buffer a thread keeps for reuse
+#define DEFAULT_PAGE 20     // Posts shown by a paged command without a limit
+#define MAX_PAGE 1000       // Most posts one page may ask for
+#define DEFAULT_SUGGEST 10  // Friends suggested when no count is given
+#define LIST_CHUNK 16384    // Bytes of names list_users queues at a time
+#define LIST_CHUNKS_PER_PASS 8  // Chunks one client gets before others' turns
 
 #ifndef PORT
     #define PORT 53692
 #endif
 
-/* 
+/*
+ * One piece of a client's output queue.
+ */
+struct outbuf {
+    struct outbuf *next;
+    size_t len;     // bytes stored in data
+    size_t cap;
+    size_t off;     // bytes of data already sent
+    char data[];
+};
+
+/*
+ * One event loop.  With -t N the server runs N reactors, one per thread,
+ * each with its own listening socket (bound with SO_REUSEPORT, so the
+ * kernel spreads new connections over them) and its own clients.  A
+ * client is only ever read, flushed and freed by the reactor that owns it.
+ */
+struct reactor {
+    int epfd;       // epoll instance watching listenfd, wakefd and every client
+    int listenfd;
+    int wakefd;     // eventfd other reactors use to wake this one
+    struct client *top;         // clients owned by this reactor
+    struct client *dirty_list;  // clients with output to flush
+    struct client *dead_list;   // clients to close after this wakeup
+    pthread_mutex_t inbox_lock;
+    struct client *inbox;       // clients other reactors queued output for
+    struct client *resume_list; // clients with work no event will announce
+    pthread_t thread;
+};
+
+/*
  * Client struct to support multiple file descriptors
  * Taken from sample server
+ * The list is doubly linked so a client can be removed in O(1).
  */
 struct client {
     int fd;
     char name[MAX_NAME];
     struct in_addr ipaddr;
     struct client *next;
+    struct client *prev;
     int user_flag;
-} *top = NULL;
+    struct reactor *owner;
+    char *inbuf;    // bytes received but not yet executed
+    int inbuf_len;
+    int inbuf_cap;  // grows up to MAX_LINE
+    int dirty;                  // 1 while on the dirty list
+    struct client *next_dirty;
+    int dead;                   // 1 once marked for disconnection
+    struct client *next_dead;
+    struct client *next_session;    // same session bucket, once logged in
+    struct client *prev_session;
+    const User *listing;        // next user list_users will send, or NULL
+    int resuming;               // 1 while on the resume list
+    struct client *next_resume;
+
+    // Fields below may be touched by other reactors.
+    pthread_mutex_t lock;       // guards the output queue and doomed
+    struct outbuf *out_head;    // replies and notifications not yet sent
+    struct outbuf *out_tail;
+    size_t queued;              // unsent bytes in the output queue
+    int doomed;                 // 1 once over the high-water mark
+    int pending;                // 1 while on the owner's inbox (inbox_lock)
+    struct client *next_pending;
+};
 
+// The user graph.  Commands that only read it share the lock.
+static pthread_rwlock_t graph_lock = PTHREAD_RWLOCK_INITIALIZER;
 static User *user_list = NULL;
-static User *user = NULL;
-static int listenfd;
-static void addclient(int fd, struct in_addr addr);
-static void removeclient(int fd);
 
-/* 
+static struct reactor reactors[MAX_REACTORS];
+static int nreactors = 1;
+static __thread struct reactor *self;   // reactor run by this thread
+static __thread StrBuf reply;           // where this thread renders large replies
+
+static const char *data_dir = NULL;    // -D: keep the graph on disk here
+static uint64_t snapshot_bytes = DEFAULT_SNAPSHOT_BYTES;
+
+/*
+ * What a snapshot child reports through its pipe before it exits.
+ */
+struct bgsave_result {
+    int ok;
+    long bytes;         // size of the snapshot
+    long cow_kb;        // memory copied while it ran (the child's private dirty pages)
+};
+
+/*
+ * Background snapshot state.  A snapshot is written by a forked child,
+ * which sees the graph as it was at fork() while the reactors carry on
+ * changing it; the kernel copies a page only when one side writes to it.
+ * The reactor that forked watches the child's pipe and finishes up.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pid_t pid;                  // running child, or 0
+    int fd;                     // read end of its pipe
+    uint64_t gen;               // log generation the snapshot leads into
+    struct reactor *owner;      // reactor watching fd
+    struct timespec start;
+    double fork_ms;
+    unsigned long saves;        // snapshots finished, good or bad
+    struct bgsave_result last;
+    double last_ms;
+    double last_fork_ms;
+} bgsave = {PTHREAD_MUTEX_INITIALIZER, 0, -1};
+
+static size_t high_water = DEFAULT_HIGH_WATER;
+static int shed_slow = 0;   // 1 to drop messages to slow clients instead of closing them
+static int nclients = 0;
+
+/*
+ * Logged-in clients, chained in buckets by a hash of their user name, so
+ * a notification only looks at the sessions that might belong to its
+ * recipient.  A user may be logged in more than once.
+ */
+static pthread_rwlock_t session_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct client **session_buckets = NULL;
+static size_t session_nbuckets = 0;     // a power of two
+static size_t nsessions = 0;
+
+// Output queue and profile cache statistics, reported by the stats
+// command.  Every reactor updates them, so they are only changed with
+// atomic adds.
+static struct {
+    size_t queued;              // bytes waiting in all queues
+    size_t peak_queued;
+    unsigned long writevs;
+    unsigned long shed;         // messages dropped for slow clients
+    unsigned long slow_closed;  // clients disconnected for being slow
+    unsigned long profile_hits;
+    unsigned long profile_misses;
+} out_stats;
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&out_stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&out_stats.field, __ATOMIC_RELAXED)
+
+static struct client *addclient(struct reactor *r, int fd, struct in_addr addr);
+static void removeclient(struct client *p);
+
+/*
  * Print a formatted error message to stderr.
  */
 void error(char *msg) {
     fprintf(stderr, "Error: %s\n", msg);
 }
 
-/* 
+static size_t hash_name(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name != '\0') {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Put p at the front of its bucket.  Caller holds session_lock for writing.
+ */
+static void session_link(struct client *p) {
+    struct client **bucket = &session_buckets[hash_name(p->name) & (session_nbuckets - 1)];
+    p->prev_session = NULL;
+    p->next_session = *bucket;
+    if (*bucket) {
+        (*bucket)->prev_session = p;
+    }
+    *bucket = p;
+}
+
+/*
+ * Rehash every session into new_size buckets.
+ */
+static void session_resize(size_t new_size) {
+    struct client **old = session_buckets;
+    size_t old_size = session_nbuckets;
+
+    session_buckets = calloc(new_size, sizeof(struct client *));
+    if (session_buckets == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    session_nbuckets = new_size;
+    for (size_t i = 0; i < old_size; i++) {
+        struct client *curr = old[i];
+        while (curr != NULL) {
+            struct client *next = curr->next_session;
+            session_link(curr);
+            curr = next;
+        }
+    }
+    free(old);
+}
+
+/*
+ * Record that client p is now logged in as p->name.
+ */
+static void session_add(struct client *p) {
+    pthread_rwlock_wrlock(&session_lock);
+    if (nsessions >= session_nbuckets) {   // Keep chains short
+        session_resize(session_nbuckets ? session_nbuckets * 2 : MIN_SESSION_BUCKETS);
+    }
+    session_link(p);
+    nsessions++;
+    pthread_rwlock_unlock(&session_lock);
+}
+
+/*
+ * Forget session p.  Once this returns, no other reactor can reach p.
+ */
+static void session_remove(struct client *p) {
+    pthread_rwlock_wrlock(&session_lock);
+    if (p->prev_session) {
+        p->prev_session->next_session = p->next_session;
+    } else {
+        session_buckets[hash_name(p->name) & (session_nbuckets - 1)] = p->next_session;
+    }
+    if (p->next_session) {
+        p->next_session->prev_session = p->prev_session;
+    }
+    nsessions--;
+    pthread_rwlock_unlock(&session_lock);
+}
+
+/*
+ * Disconnect p once the current batch of events has been handled.
+ * Other code may still hold p until then, so it is not freed here.
+ * Only p's own reactor may call this.
+ */
+static void drop_client(struct client *p) {
+    if (!p->dead) {
+        p->dead = 1;
+        p->next_dead = p->owner->dead_list;
+        p->owner->dead_list = p;
+        pthread_mutex_lock(&p->lock);
+        p->doomed = 1;      // no point queueing anything more
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+/*
+ * Put p on the list of clients whose queues are flushed at the end of
+ * this wakeup.  Only p's own reactor may call this.
+ */
+static void mark_dirty(struct client *p) {
+    if (!p->dirty && !p->dead) {
+        p->dirty = 1;
+        p->next_dirty = p->owner->dirty_list;
+        p->owner->dirty_list = p;
+    }
+}
+
+/*
+ * Put p on the list of clients to come back to before waiting for more
+ * events: its listing is to continue, or it has commands waiting for a
+ * listing to end.  Only p's own reactor may call this.
+ */
+static void add_resume(struct client *p) {
+    if (!p->resuming && !p->dead) {
+        p->resuming = 1;
+        p->next_resume = p->owner->resume_list;
+        p->owner->resume_list = p;
+    }
+}
+
+/*
+ * Ask p's reactor to look at p: it has new output, or has gone over the
+ * high-water mark.
+ */
+static void wake_owner(struct client *p) {
+    struct reactor *r = p->owner;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&r->inbox_lock);
+    int was_pending = p->pending;
+    if (!was_pending) {
+        p->pending = 1;
+        p->next_pending = r->inbox;
+        r->inbox = p;
+    }
+    pthread_mutex_unlock(&r->inbox_lock);
+
+    if (!was_pending && write(r->wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write to eventfd");
+    }
+}
+
+/*
+ * Take the clients other reactors have queued output for.
+ */
+static void drain_inbox(struct reactor *r) {
+    uint64_t count;
+    if (read(r->wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read from eventfd");
+    }
+
+    pthread_mutex_lock(&r->inbox_lock);
+    for (struct client *p = r->inbox; p != NULL; p = p->next_pending) {
+        p->pending = 0;
+        pthread_mutex_lock(&p->lock);
+        int doomed = p->doomed;
+        pthread_mutex_unlock(&p->lock);
+        if (doomed) {
+            drop_client(p);
+        } else {
+            mark_dirty(p);
+        }
+    }
+    r->inbox = NULL;
+    pthread_mutex_unlock(&r->inbox_lock);
+}
+
+/*
+ * Queue len bytes of buf for p.  Nothing is written here, so a client
+ * that is not reading can never block the server.  A client whose queue
+ * would grow past high_water is disconnected, or with -s just misses
+ * this message.  p may belong to another reactor, which is then woken
+ * up to send it.
+ */
+void send_client(struct client *p, const char *buf, size_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (p->doomed) {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+    if (p->queued + len > high_water) {
+        if (shed_slow) {
+            STAT_ADD(shed, 1);
+            pthread_mutex_unlock(&p->lock);
+            return;
+        }
+        STAT_ADD(slow_closed, 1);
+        p->doomed = 1;
+    } else {
+        struct outbuf *tail = p->out_tail;
+        if (tail == NULL || tail->cap - tail->len < len) {
+            size_t cap = len > OUT_CHUNK ? len : OUT_CHUNK;
+            struct outbuf *b = malloc(sizeof(struct outbuf) + cap);
+            if (b == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            b->next = NULL;
+            b->len = 0;
+            b->cap = cap;
+            b->off = 0;
+            if (tail) {
+                tail->next = b;
+            } else {
+                p->out_head = b;
+            }
+            p->out_tail = tail = b;
+        }
+        memcpy(tail->data + tail->len, buf, len);
+        tail->len += len;
+        p->queued += len;
+
+        size_t total = STAT_ADD(queued, len);
+        if (total > STAT_GET(peak_queued)) {
+            __atomic_store_n(&out_stats.peak_queued, total, __ATOMIC_RELAXED);
+        }
+    }
+    int doomed = p->doomed;
+    pthread_mutex_unlock(&p->lock);
+
+    if (p->owner != self) {
+        wake_owner(p);
+    } else if (doomed) {
+        drop_client(p);
+    } else {
+        mark_dirty(p);
+    }
+}
+
+/*
+ * Queue a null-terminated string for p.
+ */
+void send_str(struct client *p, const char *s) {
+    send_client(p, s, strlen(s));
+}
+
+/*
+ * Queue a formatted message for p.
+ */
+void send_vfmt(struct client *p, const char *fmt, va_list ap) {
+    char small[INPUT_BUFFER_SIZE];
+    va_list again;
+
+    va_copy(again, ap);
+    int len = vsnprintf(small, sizeof(small), fmt, ap);
+    if (len >= 0 && len < (int) sizeof(small)) {
+        send_client(p, small, len);
+    } else if (len >= 0) {
+        char *big = malloc(len + 1);
+        if (big == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        vsnprintf(big, len + 1, fmt, again);
+        send_client(p, big, len);
+        free(big);
+    }
+    va_end(again);
+}
+
+/*
+ * Queue what this thread rendered into reply for p.  A reply buffer that
+ * grew very large is let go rather than kept for the next command.
+ */
+void send_reply(struct client *p) {
+    send_client(p, reply.data, reply.len);
+    if (reply.cap > MAX_KEPT_REPLY) {
+        sb_free(&reply);
+    }
+}
+
+void send_fmt(struct client *p, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    send_vfmt(p, fmt, ap);
+    va_end(ap);
+}
+
+/*
+ * Queue a formatted message for every session of the user called name.
+ * Holding session_lock keeps those sessions from being freed meanwhile.
+ * Another reactor may flush the message before this one next commits,
+ * so for a session there the change it reports is made durable first.
+ */
+void notify_user(const char *name, const char *fmt, ...) {
+    int committed = 0;
+    pthread_rwlock_rdlock(&session_lock);
+    if (session_nbuckets > 0) {
+        struct client *curr = session_buckets[hash_name(name) & (session_nbuckets - 1)];
+        for (; curr != NULL; curr = curr->next_session) {
+            if (strcmp(curr->name, name) == 0) {
+                if (curr->owner != self && !committed) {
+                    wal_commit();
+                    committed = 1;
+                }
+                va_list ap;
+                va_start(ap, fmt);
+                send_vfmt(curr, fmt, ap);
+                va_end(ap);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&session_lock);
+}
+
+/*
+ * Write as much of p's queue as the socket will take, up to IOV_BATCH
+ * chunks per writev().  Whatever is left goes out when EPOLLOUT says the
+ * socket has room again.
+ * Return -1 if the connection is broken, 0 otherwise.
+ */
+static int flush_client(struct client *p) {
+    int result = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->out_head != NULL) {
+        struct iovec iov[IOV_BATCH];
+        int n = 0;
+        for (struct outbuf *b = p->out_head; b != NULL && n < IOV_BATCH; b = b->next) {
+            iov[n].iov_base = b->data + b->off;
+            iov[n].iov_len = b->len - b->off;
+            n++;
+        }
+
+        ssize_t nbytes = writev(p->fd, iov, n);
+        if (nbytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                result = -1;
+            }
+            break;
+        }
+        STAT_ADD(writevs, 1);
+        p->queued -= nbytes;
+        STAT_ADD(queued, -(size_t) nbytes);
+
+        // release fully written chunks
+        while (nbytes > 0) {
+            struct outbuf *b = p->out_head;
+            size_t left = b->len - b->off;
+            if ((size_t) nbytes < left) {
+                b->off += nbytes;
+                break;
+            }
+            nbytes -= left;
+            p->out_head = b->next;
+            free(b);
+        }
+        if (p->out_head == NULL) {
+            p->out_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return result;
+}
+
+static double ms_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Return the kilobytes of this process's memory that are no longer shared
+ * with its parent, or -1 if unknown.  Uses no stdio, for a forked child.
+ */
+static long private_dirty_kb(void) {
+    char buf[4096];
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    char *field = strstr(buf, "Private_Dirty:");
+    return field == NULL ? -1 : strtol(field + strlen("Private_Dirty:"), NULL, 10);
+}
+
+/*
+ * Body of the snapshot child: write the graph, report through fd, exit.
+ * Only this thread exists in the child, so the graph cannot change.
+ */
+static void bgsave_child(int fd, uint64_t gen) {
+    struct bgsave_result result = {0, 0, 0};
+
+    // Hold no client sockets open: a client the parent closes must see it.
+    if (dup2(fd, 3) == -1) {
+        _exit(1);
+    }
+    close_range(4, ~0U, 0);
+    result.ok = snapshot_write(user_list, gen, &result.bytes) == 0;
+    result.cow_kb = private_dirty_kb();
+    write(3, &result, sizeof(result));
+    _exit(0);
+}
+
+/*
+ * Start writing a snapshot in the background: begin a new log, then fork
+ * a child to write the graph as it stands.  The graph is held still only
+ * for the fork itself.
+ * Return 0 if started, 1 if a snapshot is already being written, -1 on error.
+ */
+static int start_bgsave(void) {
+    int fds[2];
+
+    pthread_mutex_lock(&bgsave.lock);
+    if (bgsave.pid != 0) {
+        pthread_mutex_unlock(&bgsave.lock);
+        return 1;
+    }
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        pthread_mutex_unlock(&bgsave.lock);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &bgsave.start);
+    pthread_rwlock_rdlock(&graph_lock);
+    uint64_t gen = wal_rotate();
+    pid_t pid = fork();
+    if (pid == 0) {
+        bgsave_child(fds[1], gen);
+    }
+    pthread_rwlock_unlock(&graph_lock);
+    bgsave.fork_ms = ms_since(&bgsave.start);
+    close(fds[1]);
+    if (pid == -1) {
+        // The new log is simply continued; the next attempt rotates again.
+        perror("fork");
+        close(fds[0]);
+        pthread_mutex_unlock(&bgsave.lock);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &bgsave;
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fds[0], &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    bgsave.pid = pid;
+    bgsave.fd = fds[0];
+    bgsave.gen = gen;
+    bgsave.owner = self;
+    pthread_mutex_unlock(&bgsave.lock);
+    return 0;
+}
+
+/*
+ * The snapshot child has reported (or died): collect it, and once the
+ * snapshot is safely on disk remove the logs it covers.
+ */
+static void finish_bgsave(void) {
+    struct bgsave_result result = {0, 0, -1};
+    int status;
+
+    pthread_mutex_lock(&bgsave.lock);
+    if (read(bgsave.fd, &result, sizeof(result)) != sizeof(result)) {
+        result.ok = 0;
+    }
+    if (waitpid(bgsave.pid, &status, 0) == -1) {
+        perror("waitpid");
+    }
+    epoll_ctl(bgsave.owner->epfd, EPOLL_CTL_DEL, bgsave.fd, NULL);
+    close(bgsave.fd);
+
+    bgsave.last = result;
+    bgsave.last_ms = ms_since(&bgsave.start);
+    bgsave.last_fork_ms = bgsave.fork_ms;
+    bgsave.saves++;
+    bgsave.pid = 0;
+    bgsave.fd = -1;
+    if (result.ok) {
+        wal_drop_before(bgsave.gen);
+        fprintf(stderr, "Saved snapshot: %ld bytes in %.1f ms (fork %.1f ms), %ld KB copied on write\n",
+                result.bytes, bgsave.last_ms, bgsave.last_fork_ms, result.cow_kb);
+    } else {
+        fprintf(stderr, "Background snapshot failed; keeping the logs\n");
+    }
+    pthread_mutex_unlock(&bgsave.lock);
+}
+
+/*
+ * Once the log has grown past snapshot_bytes, start a background snapshot.
+ */
+static void maybe_snapshot(void) {
+    if (data_dir != NULL && wal_size() >= snapshot_bytes) {
+        start_bgsave();
+    }
+}
+
+/*
+ * Queue more of p's user list while little of it is waiting to be sent,
+ * then flush it.  Only LIST_CHUNK bytes at a time are rendered and queued,
+ * so a listing of any length costs constant memory, and the socket's
+ * drain (EPOLLOUT) paces it.  After LIST_CHUNKS_PER_PASS chunks p waits
+ * its turn behind the other clients.
+ * This runs after flush_and_reap's commit, and another reactor may have
+ * created a user since, so each chunk is committed before it is sent.
+ */
+static void continue_listing(struct client *p) {
+    for (int i = 0; i < LIST_CHUNKS_PER_PASS; i++) {
+        pthread_mutex_lock(&p->lock);
+        size_t queued = p->queued;
+        pthread_mutex_unlock(&p->lock);
+        if (queued >= LIST_CHUNK) {
+            return;     // EPOLLOUT brings it back
+        }
+
+        sb_clear(&reply);
+        pthread_rwlock_rdlock(&graph_lock);
+        p->listing = render_users_upto(&reply, p->listing, LIST_CHUNK);
+        pthread_rwlock_unlock(&graph_lock);
+        wal_commit();   // every user rendered was logged under the write lock
+        send_client(p, reply.data, reply.len);
+        if (p->listing == NULL) {
+            add_resume(p);  // for the commands that waited
+            return;
+        }
+        if (flush_client(p) == -1) {
+            drop_client(p);
+            return;
+        }
+    }
+    add_resume(p);
+}
+
+/*
+ * Flush every client of r that had output queued during this wakeup,
+ * then close the clients that were marked for disconnection.  A dead
+ * client leaves the session index first, so no other reactor can still
+ * be queueing output for it when it is freed.
+ * Changes are made durable before any output goes out, so a reply never
+ * reports a change that a crash could lose.  All the changes made during
+ * the wakeup share one sync.
+ */
+static void flush_and_reap(struct reactor *r) {
+    wal_commit();
+    while (r->dirty_list != NULL || r->dead_list != NULL) {
+        while (r->dirty_list != NULL) {
+            struct client *p = r->dirty_list;
+            r->dirty_list = p->next_dirty;
+            p->dirty = 0;
+            if (!p->dead && flush_client(p) == -1) {
+                drop_client(p);
+            } else if (!p->dead && p->listing != NULL && !p->resuming) {
+                continue_listing(p);
+            }
+        }
+        if (r->dead_list == NULL) {
+            break;
+        }
+
+        struct client *dead = r->dead_list;
+        r->dead_list = NULL;
+        for (struct client *p = dead; p != NULL; p = p->next_dead) {
+            if (p->user_flag == 0) {
+                session_remove(p);
+            }
+        }
+        drain_inbox(r);     // forget any wakeups for them
+        wal_commit();       // the next pass may flush clients it marked dirty
+        for (struct client **pp = &r->resume_list; *pp != NULL;) {
+            if ((*pp)->dead) {
+                *pp = (*pp)->next_resume;
+            } else {
+                pp = &(*pp)->next_resume;
+            }
+        }
+        while (dead != NULL) {
+            struct client *p = dead;
+            dead = p->next_dead;
+            close(p->fd);   // also removes it from epfd
+            removeclient(p);
+        }
+    }
+}
+
+/*
+ * Read the optional "[offset] [limit]" that follow a user name at
+ * cmd_argv[2].  Return 0 on success, -1 if either is not a number.
+ */
+static int parse_page(int cmd_argc, char **cmd_argv, uint32_t *offset, uint32_t *limit) {
+    char *end;
+    unsigned long value;
+
+    *offset = 0;
+    *limit = DEFAULT_PAGE;
+    if (cmd_argc > 2) {
+        value = strtoul(cmd_argv[2], &end, 10);
+        if (*end != '\0' || cmd_argv[2][0] == '-' || value > UINT32_MAX) {
+            return -1;
+        }
+        *offset = value;
+    }
+    if (cmd_argc > 3) {
+        value = strtoul(cmd_argv[3], &end, 10);
+        if (*end != '\0' || cmd_argv[3][0] == '-' || value == 0) {
+            return -1;
+        }
+        *limit = value < MAX_PAGE ? value : MAX_PAGE;
+    }
+    return 0;
+}
+
+/*
  * Read and process commands, taken from friendme.c and modified slightly
+ * The user graph is locked only around the calls into friends.c; replies
+ * and notifications are queued after the lock is released.
  * Return:  -1 for quit command
  *          0 otherwise
  */
-int process_args(int cmd_argc, char **cmd_argv, int fd, int user_flag) {
-    char message[INPUT_BUFFER_SIZE];
-
+int process_args(int cmd_argc, char **cmd_argv, struct client *p) {
     if (cmd_argc <= 0) {
         return 0;
     } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
         return -1;
-    } else if (user_flag == 1) {
+    } else if (p->user_flag == 1) {
         // truncate user name
         if (strlen(cmd_argv[0]) > 31) {
             cmd_argv[0][30] = '\n';
             cmd_argv[0][31] = '\0';
         }
-        if (create_user(cmd_argv[0], &user_list) == 1) {    // create user and put in user_list
-            write(fd, "Welcome back.\r\nGo ahead and enter user commands>\r\n",
-                sizeof("Welcome back.\r\nGo ahead and enter user commands>\r\n"));
+        pthread_rwlock_wrlock(&graph_lock);
+        int result = create_user(cmd_argv[0], &user_list);    // create user and put in user_list
+        if (result == 0) {
+            wal_user(cmd_argv[0]);
+        }
+        pthread_rwlock_unlock(&graph_lock);
+        if (result == 1) {
+            send_str(p, "Welcome back.\r\nGo ahead and enter user commands>\r\n");
         } else {
-            write(fd, "Welcome.\r\nGo ahead and enter user commands>\r\n",
-                sizeof("Welcome.\r\nGo ahead and enter user commands>\r\n"));
+            send_str(p, "Welcome.\r\nGo ahead and enter user commands>\r\n");
         }
+        strncpy(p->name, cmd_argv[0], MAX_NAME);
+        p->user_flag = 0;
+        session_add(p);
     } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
-        char *list_buf = list_users(user_list);
-        write(fd, list_buf, strlen(list_buf));
-        free(list_buf);
+        // Sent a chunk at a time by continue_listing.  Commands after
+        // this one wait until it is done, so replies stay in order.
+        pthread_rwlock_rdlock(&graph_lock);
+        p->listing = user_list;
+        pthread_rwlock_unlock(&graph_lock);
+        mark_dirty(p);
     } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 2) {
-        switch (make_friends(cmd_argv[1], user->name, user_list)) {
+        pthread_rwlock_wrlock(&graph_lock);
+        int result = make_friends(cmd_argv[1], p->name, user_list);
+        if (result == 0) {
+            wal_friends(cmd_argv[1], p->name);
+        }
+        pthread_rwlock_unlock(&graph_lock);
+        switch (result) {
             case 0:
-                strcpy(message, "You are now friends with ");
-                strcat(message, cmd_argv[1]);
-                strcat(message, ".\r\n");
-                write(fd, message, strlen(message));
-                
-                struct client *curr = top;
-                while (curr != NULL) {
-                    if (strcmp(curr->name, cmd_argv[1]) == 0) {
-                        strcpy(message, "You have been friended by ");
-                        strcat(message, user->name);
-                        strcat(message, ".\r\n");
-                        write(curr->fd, message, strlen(message));
-                    }
-                    curr = curr->next;
-                }
+                send_fmt(p, "You are now friends with %s.\r\n", cmd_argv[1]);
+                notify_user(cmd_argv[1], "You have been friended by %s.\r\n", p->name);
                 break;
             case 1:
-                write(fd, "You are already friends\r\n", 
-                    sizeof("You are already friends\r\n"));
-                break;
-            case 2:
-                write(fd, "At least one user you entered has the max number of friends\r\n", 
-                    sizeof("At least one user you entered has the max number of friends\r\n"));
+                send_str(p, "You are already friends\r\n");
                 break;
             case 3:
-                write(fd, "You can't friend yourself\r\n", 
-                    sizeof("You can't friend yourself\r\n"));
+                send_str(p, "You can't friend yourself\r\n");
                 break;
             case 4:
-                write(fd, "The user you entered does not exist\r\n",
-                    sizeof("The user you entered does not exist\r\n"));
+                send_str(p, "The user you entered does not exist\r\n");
                 break;
         }
     } else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 3) {
-        // first determine how long a string we need
-        int space_needed = 0;
+        // Join the words into one string
+        sb_clear(&reply);
+        sb_puts(&reply, cmd_argv[2]);
         for (int i = 3; i < cmd_argc; i++) {
-            space_needed += strlen(cmd_argv[i]) + 1;
+            sb_append(&reply, " ", 1);
+            sb_puts(&reply, cmd_argv[i]);
         }
 
-        // allocate the space
-        char *contents = malloc(space_needed);
-        if (contents == NULL) {
-            perror("malloc");
-            exit(1);
-        }
-
-        // copy in the bits to make a single string
-        strcpy(contents, cmd_argv[2]);
-        for (int i = 3; i < cmd_argc; i++) {
-            strcat(contents, " ");
-            strcat(contents, cmd_argv[i]);
-        }
-
-        User *author = find_user(user->name, user_list);
+        pthread_rwlock_wrlock(&graph_lock);
+        User *author = find_user(p->name, user_list);
         User *target = find_user(cmd_argv[1], user_list);
-        switch (make_post(author, target, contents)) {
+        int result = make_post(author, target, reply.data);
+        if (result == 0) {
+            wal_post(author->name, target->name, target->posts[target->nposts - 1]->date, reply.data);
+        }
+        pthread_rwlock_unlock(&graph_lock);
+        switch (result) {
             case 0:
-                strcpy(message, "From ");
-                struct client *curr = top;
-                while (curr != NULL) {
-                    if (strcmp(curr->name, cmd_argv[1]) == 0) {
-                        strcat(message, user->name);
-                        strcat(message, ": ");
-                        strcat(message, contents);
-                        strcat(message, "\r\n");
-                        write(curr->fd, message, strlen(message));
-                    }
-                    curr = curr->next;
-                }
+                notify_user(cmd_argv[1], "From %s: %s\r\n", p->name, reply.data);
                 break;
             case 1:
-                write(fd, "You can only post to your friends\r\n", 
-                    sizeof("You can only post to your friends\r\n"));
+                send_str(p, "You can only post to your friends\r\n");
                 break;
             case 2:
-                write(fd, "The user you want to post to does not exist\r\n",
-                    sizeof("The user you want to post to does not exist\r\n"));
+                send_str(p, "The user you want to post to does not exist\r\n");
                 break;
         }
     } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
-        User *curr = find_user(cmd_argv[1], user_list);
-        char *profile_buf = NULL;
-        profile_buf = print_user(curr);
-        if (profile_buf == NULL) {
-            write(fd, "User not found\r\n", sizeof("Useaa   afterr not found\r\n"));
+        // Queued straight from the cache: the profile cannot be replaced
+        // while the read lock is held.
+        pthread_rwlock_rdlock(&graph_lock);
+        User *user = find_user(cmd_argv[1], user_list);
+        if (user != NULL) {
+            int hit;
+            const Profile *profile = get_profile(user, &hit);
+            send_client(p, profile->data, profile->len);
+            STAT_ADD(profile_hits, hit);
+            STAT_ADD(profile_misses, !hit);
+        }
+        pthread_rwlock_unlock(&graph_lock);
+        if (user == NULL) {
+            send_str(p, "User not found\r\n");
+        }
+    } else if ((strcmp(cmd_argv[0], "profile") == 0 && cmd_argc >= 3 && cmd_argc <= 4) ||
+               (strcmp(cmd_argv[0], "posts") == 0 && cmd_argc >= 2 && cmd_argc <= 4)) {
+        uint32_t offset, limit;
+        if (parse_page(cmd_argc, cmd_argv, &offset, &limit) == -1) {
+            send_str(p, "Offset and limit must be numbers (limit at least 1)\r\n");
+            return 0;
+        }
+        sb_clear(&reply);
+        pthread_rwlock_rdlock(&graph_lock);
+        User *user = find_user(cmd_argv[1], user_list);
+        if (user != NULL && strcmp(cmd_argv[0], "profile") == 0) {
+            render_user_page(&reply, user, offset, limit);
+        } else if (user != NULL) {
+            render_posts(&reply, user, offset, limit);
+        }
+        pthread_rwlock_unlock(&graph_lock);
+        if (user == NULL) {
+            send_str(p, "User not found\r\n");
+        } else {
+            send_reply(p);
+        }
+    } else if (strcmp(cmd_argv[0], "feed") == 0 && cmd_argc <= 2) {
+        uint32_t limit = DEFAULT_PAGE;
+        if (cmd_argc == 2) {
+            char *end;
+            unsigned long value = strtoul(cmd_argv[1], &end, 10);
+            if (*end != '\0' || cmd_argv[1][0] == '-' || value == 0) {
+                send_str(p, "Limit must be a number (at least 1)\r\n");
+                return 0;
+            }
+            limit = value < FEED_LEN ? value : FEED_LEN;
+        }
+        sb_clear(&reply);
+        pthread_rwlock_rdlock(&graph_lock);
+        User *user = find_user(p->name, user_list);
+        while (!feed_ready(user)) {
+            // Building the feed changes the user, so the first one asked
+            // for takes the write lock.  Users are never freed, but a new
+            // friend may drop the feed again before the read lock is back.
+            pthread_rwlock_unlock(&graph_lock);
+            pthread_rwlock_wrlock(&graph_lock);
+            build_feed(user);
+            pthread_rwlock_unlock(&graph_lock);
+            pthread_rwlock_rdlock(&graph_lock);
+        }
+        render_feed(&reply, user, limit);
+        pthread_rwlock_unlock(&graph_lock);
+        send_reply(p);
+    } else if (strcmp(cmd_argv[0], "search") == 0 && cmd_argc >= 2 && cmd_argc <= 3) {
+        uint32_t limit = DEFAULT_PAGE;
+        if (cmd_argc == 3) {
+            char *end;
+            unsigned long value = strtoul(cmd_argv[2], &end, 10);
+            if (*end != '\0' || cmd_argv[2][0] == '-' || value == 0) {
+                send_str(p, "Limit must be a number (at least 1)\r\n");
+                return 0;
+            }
+            limit = value < MAX_PAGE ? value : MAX_PAGE;
+        }
+        sb_clear(&reply);
+        pthread_rwlock_rdlock(&graph_lock);
+        if (!search_ready(user_list)) {
+            // As for feed.  Users are only ever added to the tree once it
+            // is built, so it cannot be dropped again.
+            pthread_rwlock_unlock(&graph_lock);
+            pthread_rwlock_wrlock(&graph_lock);
+            build_search(user_list);
+            pthread_rwlock_unlock(&graph_lock);
+            pthread_rwlock_rdlock(&graph_lock);
+        }
+        render_search(&reply, cmd_argv[1], user_list, limit);
+        pthread_rwlock_unlock(&graph_lock);
+        send_reply(p);
+    } else if (strcmp(cmd_argv[0], "mutual") == 0 && cmd_argc == 2) {
+        sb_clear(&reply);
+        pthread_rwlock_rdlock(&graph_lock);
+        User *user = find_user(p->name, user_list);
+        User *other = find_user(cmd_argv[1], user_list);
+        if (other != NULL) {
+            render_mutual(&reply, user, other);
+        }
+        pthread_rwlock_unlock(&graph_lock);
+        if (other == NULL) {
+            send_str(p, "User not found\r\n");
+        } else {
+            send_reply(p);
+        }
+    } else if (strcmp(cmd_argv[0], "suggest") == 0 && cmd_argc <= 2) {
+        uint32_t n = DEFAULT_SUGGEST;
+        if (cmd_argc == 2) {
+            char *end;
+            unsigned long value = strtoul(cmd_argv[1], &end, 10);
+            if (*end != '\0' || cmd_argv[1][0] == '-' || value == 0) {
+                send_str(p, "Count must be a number (at least 1)\r\n");
+                return 0;
+            }
+            n = value < MAX_SUGGEST ? value : MAX_SUGGEST;
+        }
+        sb_clear(&reply);
+        pthread_rwlock_rdlock(&graph_lock);
+        render_suggestions(&reply, find_user(p->name, user_list), n);
+        pthread_rwlock_unlock(&graph_lock);
+        send_reply(p);
+    } else if (strcmp(cmd_argv[0], "bgsave") == 0 && cmd_argc == 1) {
+        if (data_dir == NULL) {
+            send_str(p, "Not persisting: start the server with -D\r\n");
+        } else if (start_bgsave() == 1) {
+            send_str(p, "Background save already in progress\r\n");
         } else {
-            write(fd, profile_buf, strlen(profile_buf));
+            send_str(p, "Background save started\r\n");
         }
-        free(profile_buf);
+    } else if (strcmp(cmd_argv[0], "stats") == 0 && cmd_argc == 1) {
+        pthread_rwlock_rdlock(&session_lock);
+        size_t logged_in = nsessions;
+        pthread_rwlock_unlock(&session_lock);
+        pthread_mutex_lock(&p->lock);
+        size_t mine = p->queued;
+        pthread_mutex_unlock(&p->lock);
+
+        send_fmt(p, "Clients: %d (%zu logged in)\r\n"
+                    "Reactor threads: %d\r\n"
+                    "Queued bytes: %zu (yours: %zu)\r\n"
+                    "Peak queued bytes: %zu\r\n"
+                    "High-water mark: %zu bytes per client\r\n"
+                    "writev calls: %lu\r\n"
+                    "Messages shed: %lu\r\n"
+                    "Slow clients disconnected: %lu\r\n"
+                    "Profile cache: %lu hits, %lu misses\r\n",
+                 __atomic_load_n(&nclients, __ATOMIC_RELAXED), logged_in, nreactors,
+                 STAT_GET(queued), mine, STAT_GET(peak_queued), high_water,
+                 STAT_GET(writevs), STAT_GET(shed), STAT_GET(slow_closed),
+                 STAT_GET(profile_hits), STAT_GET(profile_misses));
+        pthread_mutex_lock(&bgsave.lock);
+        if (bgsave.pid != 0) {
+            send_fmt(p, "Background save: running for %.1f ms\r\n", ms_since(&bgsave.start));
+        } else if (bgsave.saves > 0) {
+            send_fmt(p, "Last background save: %s, %ld bytes in %.1f ms (fork %.1f ms), "
+                        "%ld KB copied on write\r\n",
+                     bgsave.last.ok ? "ok" : "failed", bgsave.last.bytes, bgsave.last_ms,
+                     bgsave.last_fork_ms, bgsave.last.cow_kb);
+        }
+        pthread_mutex_unlock(&bgsave.lock);
     } else {
-        write(fd, "Incorrect syntax\r\n", sizeof("Incorrect syntax\r\n"));
+        send_str(p, "Incorrect syntax\r\n");
     }
     return 0;
 }
@@ -176,7 +1062,8 @@ int process_args(int cmd_argc, char **cmd_argv, int fd, int user_flag) {
  */
 int tokenize(char *cmd, char **cmd_argv) {
     int cmd_argc = 0;
-    char *next_token = strtok(cmd, DELIM);    
+    char *saveptr;
+    char *next_token = strtok_r(cmd, DELIM, &saveptr);
     while (next_token != NULL) {
         if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
             error("Too many arguments!");
@@ -185,51 +1072,83 @@ int tokenize(char *cmd, char **cmd_argv) {
         }
         cmd_argv[cmd_argc] = next_token;
         cmd_argc++;
-        next_token = strtok(NULL, DELIM);
+        next_token = strtok_r(NULL, DELIM, &saveptr);
     }
     return cmd_argc;
 }
 
 
 /*
- * Set up the server.
+ * Set up one reactor: its listening socket, epoll instance and eventfd.
  * Taken from lab11 bufserver.c
  */
-void setup(void) {
+void setup(struct reactor *r) {
     int on = 1, status;
-    struct sockaddr_in self;
+    struct sockaddr_in self_addr;
 
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if ((r->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
         perror("socket");
         exit(1);
     }
 
     // Make sure we can reuse the port immediately after the
     // server terminates.
-    status = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
+    status = setsockopt(r->listenfd, SOL_SOCKET, SO_REUSEADDR, (const char *) &on, sizeof(on));
     if(status == -1) {
         perror("setsockopt -- REUSEADDR");
     }
 
-    self.sin_family = AF_INET;
-    self.sin_addr.s_addr = INADDR_ANY;
-    self.sin_port = htons(PORT);
-    memset(&self.sin_zero, 0, sizeof(self.sin_zero)); // Initialize sin_zero to 0
+    // Every reactor listens on the same port.
+    status = setsockopt(r->listenfd, SOL_SOCKET, SO_REUSEPORT, (const char *) &on, sizeof(on));
+    if(status == -1) {
+        perror("setsockopt -- REUSEPORT");
+    }
+
+    self_addr.sin_family = AF_INET;
+    self_addr.sin_addr.s_addr = INADDR_ANY;
+    self_addr.sin_port = htons(PORT);
+    memset(&self_addr.sin_zero, 0, sizeof(self_addr.sin_zero)); // Initialize sin_zero to 0
 
     //printf("Listening on %d\n", PORT);
 
-    if (bind(listenfd, (struct sockaddr *)&self, sizeof(self)) == -1) {
+    if (bind(r->listenfd, (struct sockaddr *)&self_addr, sizeof(self_addr)) == -1) {
         perror("bind"); // probably means port is in use
         exit(1);
     }
 
-    if (listen(listenfd, 5) == -1) {
+    if (listen(r->listenfd, SOMAXCONN) == -1) {
         perror("listen");
         exit(1);
     }
+
+    if ((r->epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;  // NULL marks the listening socket
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listenfd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    if ((r->wakefd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = r;     // the reactor itself marks its eventfd
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wakefd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    pthread_mutex_init(&r->inbox_lock, NULL);
+    r->top = r->dirty_list = r->dead_list = r->inbox = NULL;
 }
 
-/* 
+/*
  * Search the first inbuf characters of buf for a network newline ("\r\n").
  * Return the location of the '\r' if the network newline is found,
  * or -1 otherwise.
@@ -240,98 +1159,157 @@ int find_network_newline(const char *buf, int inbuf) {
             return i; // return the location of '\r' if found
         }
     }
-    return -1; 
+    return -1;
 }
 
-/* 
- * Accept connection, and add client.
+/*
+ * Accept every pending connection, and add clients.
+ * listenfd is edge-triggered, so keep accepting until there are none left.
  */
-void newconnection() {
+void newconnection(struct reactor *r) {
     int fd;
     struct sockaddr_in peer;
     socklen_t socklen = sizeof(peer);
 
-    if ((fd = accept(listenfd, (struct sockaddr *)&peer, &socklen)) < 0) {
-        perror("accept");
-    } else {
+    while ((fd = accept4(r->listenfd, (struct sockaddr *)&peer, &socklen,
+                         SOCK_NONBLOCK)) >= 0) {
         //printf("New connection on port %d\n", ntohs(peer.sin_port));
-        addclient(fd, peer.sin_addr);
-        // prompt client for user name
-        if (write(fd, "What is your user name?\r\n", 
-                    sizeof("What is your user name?\r\n")) == -1) {
-            perror("write to pipe");
+        struct client *p = addclient(r, fd, peer.sin_addr);
+
+        // EPOLLOUT is edge-triggered too, so it only fires when a full
+        // socket buffer drains; no need to switch it on and off.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = p;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(fd);
+            removeclient(p);
+            continue;
         }
+
+        // prompt client for user name
+        send_str(p, "What is your user name?\r\n");
+        socklen = sizeof(peer);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept");
     }
 }
 
-/* 
- * Read input
+/*
+ * Execute one complete command line from client p.
+ * Return -1 if the client quit, 0 otherwise.
  */
-void whatsup(struct client *p) {
-    int nbytes;
-    int inbuf;      // number of bytes currently in buffer
-    int room;       // room left in buffer
-    char *after;    // pointer to position after the (valid) data in buf
-    int where;      // location of network newline
-    char buf[INPUT_BUFFER_SIZE];
-    int flag = 0;
- 
-    // Receive messages
-    inbuf = 0;          // buffer is empty; has no bytes
-    room = sizeof(buf); // room == capacity of the whole buffer
-    after = buf;        // start writing at beginning of buf
+int run_command(struct client *p, char *line) {
+    char *cmd_argv[INPUT_ARG_MAX_NUM];
+    int cmd_argc = tokenize(line, cmd_argv);
 
-    while ((nbytes = read(p->fd, after, room)) > 0) {
-        flag = 0;
+    if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, p) == -1) {
+        return -1; // can only reach if quit command was entered
+    }
+    return 0;
+}
 
-        // update inbuf with nbytes (the number of bytes just read)
-        inbuf += nbytes; 
+/*
+ * Execute the complete lines in p->inbuf, looking for the end of the
+ * first one from scan_from on, and keep the rest for later.  Stops early
+ * while p is being sent a user list.
+ * Return -1 if the client quit, 0 otherwise.
+ */
+static int run_lines(struct client *p, int scan_from) {
+    int where;      // location of network newline
+    int start = 0;
+    int result = 0;
 
-        // call find_network_newline, store result in variable "where"
-        where = find_network_newline(buf, inbuf);
+    while (p->listing == NULL && !p->dead &&
+           (where = find_network_newline(p->inbuf + scan_from,
+                                         p->inbuf_len - scan_from)) >= 0) {
+        where += scan_from;
+        p->inbuf[where] = '\0';
+        if (run_command(p, p->inbuf + start) == -1) {
+            result = -1;
+            break;
+        }
+        start = where + 2;
+        scan_from = start;
+    }
 
-        if (where >= 0) { // we have a full line
-            buf[where] = '\0';
+    // memmove(destination, source, number_of_bytes)
+    p->inbuf_len -= start;
+    if (p->inbuf_len > 0 && start > 0) {
+        memmove(p->inbuf, p->inbuf + start, p->inbuf_len); // moves buf to beginning
+    }
+    return result;
+}
 
-            char *cmd_argv[INPUT_ARG_MAX_NUM];
-            int cmd_argc = tokenize(buf, cmd_argv);
-            user = find_user(p->name, user_list);
+/*
+ * Read input
+ * The socket is non-blocking and edge-triggered, so read until it would
+ * block (or the client hangs up).  Every complete line received is
+ * executed in order, so clients may pipeline commands; a partial line
+ * stays in p->inbuf until the rest of it arrives.  While a user list is
+ * being sent nothing is read, and resume_client picks up from there.
+ */
+void whatsup(struct client *p) {
+    int nbytes;
+    int flag = 0;
 
-            if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, 
-                p->fd, p->user_flag) == -1) {
+    while (!flag && !p->dead && p->listing == NULL) {
+        // make room for the next read
+        if (p->inbuf_len == p->inbuf_cap) {
+            if (p->inbuf_cap >= MAX_LINE) {
+                error("Line too long!");
                 flag = 1;
-                break; // can only reach if quit command was entered
+                break;
             }
-
-            if (p->user_flag == 1) {
-                user = find_user(buf, user_list);
-                strncpy(p->name, user->name, MAX_NAME);
-                p->user_flag = 0;
+            p->inbuf_cap *= 2;
+            p->inbuf = realloc(p->inbuf, p->inbuf_cap);
+            if (p->inbuf == NULL) {
+                perror("realloc");
+                exit(1);
             }
+        }
 
+        nbytes = read(p->fd, p->inbuf + p->inbuf_len, p->inbuf_cap - p->inbuf_len);
+        if (nbytes == 0 || (nbytes == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            flag = 1;   // client hung up
             break;
+        } else if (nbytes == -1) {
+            break;      // everything available has been read
+        }
 
-            // memmove(destination, source, number_of_bytes)
-            inbuf -= (where + 2);
-            if (inbuf > 0){
-                memmove(buf, &buf[where + 2], inbuf); // moves buf to beginning
-            }
-
+        // Only the new bytes (and a '\r' just before them) can complete a line
+        int scan_from = p->inbuf_len > 0 ? p->inbuf_len - 1 : 0;
+        p->inbuf_len += nbytes;
+        if (run_lines(p, scan_from) == -1) {
+            flag = 1;
         }
-        // update room and after, in preparation for the next read
-        room = sizeof(buf) - inbuf; 
-        after = &buf[inbuf];
     }
+
     if (flag == 1){
-        close(p->fd);
-        removeclient(p->fd);
+        drop_client(p);
     }
 }
 
-/* 
+/*
+ * Pick p up where no event would: carry on with its listing, or once that
+ * is done run the commands that waited for it and read any more.
+ */
+static void resume_client(struct client *p) {
+    if (p->listing != NULL) {
+        mark_dirty(p);
+    } else if (run_lines(p, 0) == -1) {
+        drop_client(p);
+    } else {
+        whatsup(p);
+    }
+}
+
+/*
  * Taken from sample server by Alan J Rosenthal.
  */
-static void addclient(int fd, struct in_addr addr) {
+static struct client *addclient(struct reactor *r, int fd, struct in_addr addr) {
     struct client *p = malloc(sizeof(struct client));
 
     if (!p) {
@@ -343,68 +1321,183 @@ static void addclient(int fd, struct in_addr addr) {
     fflush(stdout);
     p->fd = fd;
     p->user_flag = 1;
+    p->name[0] = '\0';
+    p->owner = r;
+    p->inbuf_len = 0;
+    p->inbuf_cap = INPUT_BUFFER_SIZE;
+    if ((p->inbuf = malloc(p->inbuf_cap)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    p->dirty = 0;
+    p->dead = 0;
+    p->listing = NULL;
+    p->resuming = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    p->out_head = p->out_tail = NULL;
+    p->queued = 0;
+    p->doomed = 0;
+    p->pending = 0;
     p->ipaddr = addr;
-    p->next = top;
-    top = p;
+    p->next = r->top;
+    p->prev = NULL;
+    if (r->top) {
+        r->top->prev = p;
+    }
+    r->top = p;
+    __atomic_add_fetch(&nclients, 1, __ATOMIC_RELAXED);
+    return p;
 }
 
-/* 
- * Taken from sample server by Alan J Rosenthal.
+/*
+ * Adapted from sample server by Alan J Rosenthal.
+ * p must already be out of the session index.
  */
-static void removeclient(int fd) {
-    struct client **p;
-    for (p = &top; *p && (*p)->fd != fd; p = &(*p)->next);
-    if (*p) {
-        struct client *t = (*p)->next;
-        //printf("Removing client %s\n", inet_ntoa((*p)->ipaddr));
-        fflush(stdout);
-        free(*p);
-        *p = t;
+static void removeclient(struct client *p) {
+    if (p->prev) {
+        p->prev->next = p->next;
     } else {
-        fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n", fd);
-        fflush(stderr);
+        p->owner->top = p->next;
+    }
+    if (p->next) {
+        p->next->prev = p->prev;
     }
+    //printf("Removing client %s\n", inet_ntoa(p->ipaddr));
+    while (p->out_head != NULL) {
+        struct outbuf *b = p->out_head;
+        p->out_head = b->next;
+        free(b);
+    }
+    STAT_ADD(queued, -p->queued);
+    __atomic_sub_fetch(&nclients, 1, __ATOMIC_RELAXED);
+    pthread_mutex_destroy(&p->lock);
+    free(p->inbuf);
+    free(p);
 }
 
-/* 
+/*
  * Majority taken from sample server by Alan J Rosenthal.
+ * Every ready fd is handled on each wakeup, so a busy client cannot hide
+ * the others, and the cost per event does not depend on how many clients
+ * are connected.
+ * Output queued while handling a batch of events is flushed once, after
+ * the whole batch, and clients are only freed at that point.
  */
-int main() {
-    struct client *p;
-    extern void setup(), newconnection(), whatsup(struct client *p);
-
-    setup();
+static void *reactor_main(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[MAX_EVENTS];
 
+    self = r;
     // the only way the server exits is by being killed
     while (1) {
-        fd_set fdlist;  // set of active sockets
-        int maxfd = listenfd;
-        FD_ZERO(&fdlist); // initializes the file descriptor set set to be the empty set
-        FD_SET(listenfd, &fdlist); // adds listenfd to the file descriptor set fdlist 
-
-        for (p = top; p; p = p->next) {
-            FD_SET(p->fd, &fdlist);
-            if (p->fd > maxfd) {
-                maxfd = p->fd;
+        int nready = epoll_wait(r->epfd, events, MAX_EVENTS, r->resume_list != NULL ? 0 : -1);
+        if (nready < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
             }
+            continue;
         }
 
-        if (select(maxfd + 1, &fdlist, NULL, NULL, NULL) < 0) {
-            perror("select");
-        } else {
-            // loops through file descriptors
-            for (p = top; p; p = p->next) {
-                if (FD_ISSET(p->fd, &fdlist)) {
-                    break;
-                }
+        for (int i = 0; i < nready; i++) {
+            struct client *p = events[i].data.ptr;
+            if (p == NULL) {
+                newconnection(r);
+                continue;
+            } else if (events[i].data.ptr == r) {
+                drain_inbox(r);
+                continue;
+            } else if (events[i].data.ptr == &bgsave) {
+                finish_bgsave();
+                continue;
+            }
+            if (p->dead) {
+                continue;
             }
-            if (p) {
+            if (events[i].events & EPOLLOUT) {
+                mark_dirty(p);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
                 whatsup(p);
             }
-            if (FD_ISSET(listenfd, &fdlist)) {
-                newconnection();
+        }
+
+        struct client *resume = r->resume_list;
+        r->resume_list = NULL;
+        while (resume != NULL) {
+            struct client *p = resume;
+            resume = p->next_resume;
+            p->resuming = 0;
+            if (!p->dead) {
+                resume_client(p);
             }
         }
+        flush_and_reap(r);
+        maybe_snapshot();
     }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    int do_sync = 1;
+
+    while ((opt = getopt(argc, argv, "q:st:D:L:N")) != -1) {
+        switch (opt) {
+            case 'q':
+                high_water = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                shed_slow = 1;
+                break;
+            case 't':
+                nreactors = strtol(optarg, NULL, 10);
+                break;
+            case 'D':
+                data_dir = optarg;
+                break;
+            case 'L':
+                snapshot_bytes = strtoull(optarg, NULL, 10);
+                break;
+            case 'N':
+                do_sync = 0;
+                break;
+            default:
+                fprintf(stderr, "Usage: friends_server [-q high_water_bytes] [-s] [-t threads]\n"
+                                "                      [-D data_dir [-L snapshot_log_bytes] [-N]]\n");
+                exit(1);
+        }
+    }
+    if (high_water == 0) {
+        fprintf(stderr, "High-water mark must be positive\n");
+        exit(1);
+    }
+    if (nreactors < 1 || nreactors > MAX_REACTORS) {
+        fprintf(stderr, "Number of threads must be between 1 and %d\n", MAX_REACTORS);
+        exit(1);
+    }
+
+    // Each connection is an fd: allow as many as the hard limit permits.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            perror("setrlimit");
+        }
+    }
+
+    if (data_dir != NULL && persist_open(data_dir, &user_list, do_sync) == -1) {
+        exit(1);
+    }
+
+    for (int i = 0; i < nreactors; i++) {
+        setup(&reactors[i]);
+    }
+    for (int i = 1; i < nreactors; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_main, &reactors[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    reactor_main(&reactors[0]);
     return 0;
-}
\ No newline at end of file
+}
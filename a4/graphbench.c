@@ -0,0 +1,182 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include "friends.h"
+
+/*
+ * Benchmark for the friendship graph queries in friends.c.
+ *
+ * Builds a synthetic power-law graph: each new user makes friends with m
+ * users already there, picked with a chance that falls off as a power of
+ * their id, so a few early users end up as hubs with a large share of all
+ * friendships.  Then times are_friends, mutual_friends (against a plain
+ * merge of the two friends arrays) and suggest_friends on random users
+ * and on pairs of friends, which are where mutual friends are asked for.
+ */
+
+#define DEFAULT_USERS 1000000
+#define DEFAULT_EDGES 5         // Friends each new user makes
+#define DEFAULT_ALPHA 0.9       // How steeply the chance of being picked falls with id
+#define DEFAULT_QUERIES 20000
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void *checked_malloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * Count mutual friends by merging both arrays, whatever their sizes: what
+ * mutual_friends is compared with.
+ */
+static uint32_t merge_count(const User *user1, const User *user2) {
+    uint32_t i = 0, j = 0, count = 0;
+    while (i < user1->nfriends && j < user2->nfriends) {
+        uint32_t a = user1->friends[i]->id, b = user2->friends[j]->id;
+        count += a == b;
+        i += a <= b;
+        j += b <= a;
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    long nusers = DEFAULT_USERS, m = DEFAULT_EDGES, nqueries = DEFAULT_QUERIES;
+    double alpha = DEFAULT_ALPHA;
+    int opt;
+    while ((opt = getopt(argc, argv, "u:m:a:q:")) != -1) {
+        switch (opt) {
+            case 'u':
+                nusers = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                m = strtol(optarg, NULL, 10);
+                break;
+            case 'a':
+                alpha = strtod(optarg, NULL);
+                break;
+            case 'q':
+                nqueries = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-u users] [-m friends per user] [-a alpha] [-q queries]\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+    if (nusers <= m || m < 1 || nqueries < 1) {
+        fprintf(stderr, "Need more users than friends per user, and a query\n");
+        exit(1);
+    }
+    srand(1);
+
+    // User i has weight (i + 1)^-alpha, and each new user makes friends
+    // with m earlier users picked in proportion to their weights.  Ids only
+    // grow, so a hub's friends array is only ever appended to.
+    User *head = NULL;
+    User **users = checked_malloc(sizeof(User *) * nusers);
+    double *weights = checked_malloc(sizeof(double) * nusers);  // running totals
+    uint32_t *ends = checked_malloc(sizeof(uint32_t) * 2 * m * nusers);
+    long nends = 0;
+    char name[MAX_NAME];
+    double start = now();
+    for (long i = 0; i < nusers; i++) {
+        snprintf(name, sizeof(name), "user%ld", i);
+        create_user(name, &head);
+        users[i] = find_user(name, head);
+        weights[i] = (i > 0 ? weights[i - 1] : 0) + pow(i + 1, -alpha);
+    }
+    for (long i = 1; i < nusers; i++) {
+        for (long k = 0; k < m && k < i; k++) {
+            double r = weights[i - 1] * rand() / ((double) RAND_MAX + 1);
+            long lo = 0, hi = i - 1;
+            while (lo < hi) {
+                long mid = lo + (hi - lo) / 2;
+                if (weights[mid] <= r) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if (make_friends(users[i]->name, users[lo]->name, head) == 0) {
+                ends[nends++] = i;
+                ends[nends++] = lo;
+            }
+        }
+    }
+    uint32_t max_friends = 0, nbitsets = 0;
+    for (long i = 0; i < nusers; i++) {
+        if (users[i]->nfriends > max_friends) {
+            max_friends = users[i]->nfriends;
+        }
+        nbitsets += users[i]->friend_bits != NULL;
+    }
+    printf("%ld users, %ld friendships in %.2f s; most friends %u, %u with bitsets\n",
+           nusers, nends / 2, now() - start, max_friends, nbitsets);
+
+    // Query pairs: friends (an end and its partner), and random users.
+    User **pairs = checked_malloc(sizeof(User *) * 4 * nqueries);
+    for (long q = 0; q < nqueries; q++) {
+        long e = (((long) rand() * RAND_MAX + rand()) % (nends / 2)) * 2;
+        pairs[4 * q] = users[ends[e]];
+        pairs[4 * q + 1] = users[ends[e + 1]];
+        pairs[4 * q + 2] = users[rand() % nusers];
+        pairs[4 * q + 3] = users[rand() % nusers];
+    }
+    const User **out = checked_malloc(sizeof(User *) * (max_friends + 1));
+
+    const char *kinds[] = {"friends", "random users"};
+    for (int kind = 0; kind < 2; kind++) {
+        long found = 0, check = 0;
+        start = now();
+        for (long q = 0; q < nqueries; q++) {
+            found += are_friends(pairs[4 * q + 2 * kind], pairs[4 * q + 2 * kind + 1]);
+        }
+        printf("are_friends, %s: %.0f ns (%ld friends)\n", kinds[kind],
+               (now() - start) / nqueries * 1e9, found);
+
+        found = 0;
+        start = now();
+        for (long q = 0; q < nqueries; q++) {
+            found += mutual_friends(pairs[4 * q + 2 * kind], pairs[4 * q + 2 * kind + 1], out);
+        }
+        double mutual_s = now() - start;
+        start = now();
+        for (long q = 0; q < nqueries; q++) {
+            check += merge_count(pairs[4 * q + 2 * kind], pairs[4 * q + 2 * kind + 1]);
+        }
+        double merge_s = now() - start;
+        printf("mutual_friends, %s: %.0f ns, plain merge %.0f ns (%ld mutual%s)\n", kinds[kind],
+               mutual_s / nqueries * 1e9, merge_s / nqueries * 1e9, found,
+               found == check ? "" : ", MISMATCH");
+    }
+
+    Suggestion suggestions[MAX_SUGGEST];
+    long nsuggest = nqueries / 100 > 0 ? nqueries / 100 : 1, found = 0;
+    start = now();
+    for (long q = 0; q < nsuggest; q++) {
+        found += suggest_friends(pairs[4 * q + 2], suggestions, 10);
+    }
+    printf("suggest_friends, 10 for random users: %.1f us (%ld found)\n",
+           (now() - start) / nsuggest * 1e6, found);
+    start = now();
+    found = suggest_friends(users[0], suggestions, 10);
+    printf("suggest_friends, 10 for %s (%u friends): %.1f ms (%ld found)\n",
+           users[0]->name, users[0]->nfriends, (now() - start) * 1e3, found);
+    return 0;
+}
@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/*
+ * Load generator for friends_server.
+ *
+ * Opens many connections, logs each one in as its own user, then sends
+ * commands at a fixed total rate (open loop: the schedule does not wait
+ * for replies) and reports throughput and latency percentiles.
+ *
+ * Replies have no framing, and a successful post has no reply at all,
+ * so every command is followed by a line the server cannot parse.  The
+ * "Incorrect syntax" answer to it marks the end of the command's reply.
+ * Latency is measured from when the command was due to be sent, not
+ * when it was, so a stalled server cannot hide its backlog.
+ */
+
+#ifndef PORT
+    #define PORT 53692
+#endif
+
+#define IN_BUFSIZE 4096         // Longest reply line that is looked at
+#define MAX_EVENTS 256
+#define SENTINEL "?\r\n"
+#define SENTINEL_REPLY "Incorrect syntax"
+#define READY_PROMPT "Go ahead and enter user commands>"
+#define LOGIN_TIMEOUT 30        // Seconds to wait for every login
+
+enum conn_state {CONNECTING, LOGGING_IN, READY, CLOSED};
+
+// The commands in the mix, in the order given to -m.
+enum command {CMD_PROFILE, CMD_POST, CMD_MAKE_FRIENDS, CMD_LIST_USERS, NCOMMANDS};
+static const char *command_names[NCOMMANDS] = {"profile", "post", "make_friends", "list_users"};
+
+struct conn {
+    int fd;
+    int id;
+    enum conn_state state;
+    char in[IN_BUFSIZE];
+    int in_len;
+    char *out;          // bytes not yet written
+    int out_len;
+    int out_cap;
+    int64_t *due;       // when each outstanding command was due, oldest first
+    int due_head;
+    int due_count;
+    int due_cap;
+};
+
+static struct conn *conns;
+static int nconns = 1000;
+static int nusers = 0;              // distinct user names, default nconns
+static double rate = 10000;         // commands per second, all connections
+static double duration = 10;        // seconds of measurement
+static int mix[NCOMMANDS] = {60, 10, 10, 20};
+static int mix_total = 100;
+static int epfd;
+static int nready = 0;              // connections logged in
+static int nclosed = 0;
+
+static int64_t *latencies;          // nanoseconds, one per reply
+static size_t nlatencies = 0;
+static size_t cap_latencies = 0;
+static long issued = 0;
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: loadgen [-c connections] [-u users] [-r rate] [-d seconds]\n"
+                    "               [-m profile,post,make_friends,list_users] [-h host] [-p port]\n");
+    exit(1);
+}
+
+/*
+ * Parse a mix such as "60,10,10,20": relative weights of profile, post,
+ * make_friends and list_users.
+ */
+static void parse_mix(char *arg) {
+    char *saveptr;
+    char *token = strtok_r(arg, ",", &saveptr);
+    mix_total = 0;
+    for (int i = 0; i < NCOMMANDS; i++) {
+        mix[i] = token ? strtol(token, NULL, 10) : 0;
+        if (mix[i] < 0) {
+            usage();
+        }
+        mix_total += mix[i];
+        token = token ? strtok_r(NULL, ",", &saveptr) : NULL;
+    }
+    if (mix_total == 0) {
+        usage();
+    }
+}
+
+/*
+ * Append len bytes to c's output and try to send them.
+ */
+static void conn_write(struct conn *c, const char *buf, int len) {
+    if (c->out_len + len > c->out_cap) {
+        c->out_cap = (c->out_len + len) * 2;
+        c->out = realloc(c->out, c->out_cap);
+        if (c->out == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(c->out + c->out_len, buf, len);
+    c->out_len += len;
+}
+
+/*
+ * Write as much buffered output as the socket takes.  The rest waits for
+ * EPOLLOUT.
+ */
+static void conn_flush(struct conn *c) {
+    int done = 0;
+    while (done < c->out_len) {
+        ssize_t n = write(c->fd, c->out + done, c->out_len - done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += n;
+    }
+    c->out_len -= done;
+    if (c->out_len > 0 && done > 0) {
+        memmove(c->out, c->out + done, c->out_len);
+    }
+}
+
+static void conn_close(struct conn *c) {
+    if (c->state == READY) {
+        nready--;
+    }
+    close(c->fd);
+    c->state = CLOSED;
+    nclosed++;
+}
+
+static void record_latency(int64_t ns) {
+    if (nlatencies == cap_latencies) {
+        cap_latencies = cap_latencies ? cap_latencies * 2 : 1 << 16;
+        latencies = realloc(latencies, sizeof(int64_t) * cap_latencies);
+        if (latencies == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    latencies[nlatencies++] = ns;
+}
+
+/*
+ * Handle one complete reply line.
+ */
+static void handle_line(struct conn *c, const char *line, int measuring) {
+    if (c->state == LOGGING_IN) {
+        if (strcmp(line, READY_PROMPT) == 0) {
+            c->state = READY;
+            nready++;
+        }
+    } else if (c->state == READY && strcmp(line, SENTINEL_REPLY) == 0 && c->due_count > 0) {
+        int64_t due = c->due[c->due_head];
+        c->due_head = (c->due_head + 1) % c->due_cap;
+        c->due_count--;
+        if (measuring && due > 0) {
+            record_latency(now_ns() - due);
+        }
+    }
+}
+
+/*
+ * Read everything available on c and act on each complete line.
+ */
+static void conn_read(struct conn *c, int measuring) {
+    while (1) {
+        if (c->in_len == IN_BUFSIZE) {
+            c->in_len = 0;  // a line this long is never one we look for
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, IN_BUFSIZE - c->in_len);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn_close(c);
+            return;
+        } else if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        int scan = c->in_len > 0 ? c->in_len - 1 : 0;
+        c->in_len += n;
+        int start = 0;
+        for (int i = scan; i + 1 < c->in_len; i++) {
+            if (c->in[i] == '\r' && c->in[i + 1] == '\n') {
+                c->in[i] = '\0';
+                handle_line(c, c->in + start, measuring);
+                start = i + 2;
+                i++;
+            }
+        }
+        c->in_len -= start;
+        if (c->in_len > 0 && start > 0) {
+            memmove(c->in, c->in + start, c->in_len);
+        }
+    }
+}
+
+/*
+ * Queue one command, chosen from the mix, on c.  due is the time it was
+ * scheduled for, or 0 if its latency should not be recorded.
+ */
+static void send_command(struct conn *c, int64_t due, long seq) {
+    char buf[128];
+    int len;
+    int pick = rand() % mix_total;
+    int cmd = 0;
+    while (pick >= mix[cmd]) {
+        pick -= mix[cmd];
+        cmd++;
+    }
+
+    int other = rand() % nusers;
+    switch (cmd) {
+        case CMD_PROFILE:
+            len = snprintf(buf, sizeof(buf), "profile lg%d\r\n" SENTINEL, other);
+            break;
+        case CMD_POST:
+            len = snprintf(buf, sizeof(buf), "post lg%d load test message %ld\r\n" SENTINEL, other, seq);
+            break;
+        case CMD_MAKE_FRIENDS:
+            len = snprintf(buf, sizeof(buf), "make_friends lg%d\r\n" SENTINEL, other);
+            break;
+        default:
+            len = snprintf(buf, sizeof(buf), "list_users\r\n" SENTINEL);
+            break;
+    }
+
+    if (c->due_count == c->due_cap) {
+        int new_cap = c->due_cap ? c->due_cap * 2 : 16;
+        int64_t *due_times = malloc(sizeof(int64_t) * new_cap);
+        if (due_times == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int i = 0; i < c->due_count; i++) {
+            due_times[i] = c->due[(c->due_head + i) % c->due_cap];
+        }
+        free(c->due);
+        c->due = due_times;
+        c->due_head = 0;
+        c->due_cap = new_cap;
+    }
+    c->due[(c->due_head + c->due_count) % c->due_cap] = due;
+    c->due_count++;
+
+    conn_write(c, buf, len);
+    conn_flush(c);
+    issued++;
+}
+
+/*
+ * Start a non-blocking connect for c.
+ */
+static void conn_open(struct conn *c, struct sockaddr_in *addr) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    c->state = CONNECTING;
+    if (connect(c->fd, (struct sockaddr *) addr, sizeof(*addr)) == -1 && errno != EINPROGRESS) {
+        perror("connect");
+        exit(1);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/*
+ * Wait up to timeout_ms for events and handle them.
+ */
+static void poll_events(int timeout_ms, int measuring) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        struct conn *c = events[i].data.ptr;
+        if (c->state == CLOSED) {
+            continue;
+        }
+        if (c->state == CONNECTING && (events[i].events & EPOLLOUT)) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) {
+                fprintf(stderr, "connect: %s\n", strerror(err));
+                conn_close(c);
+                continue;
+            }
+            char name[64];
+            int name_len = snprintf(name, sizeof(name), "lg%d\r\n", c->id % nusers);
+            c->state = LOGGING_IN;
+            conn_write(c, name, name_len);
+        }
+        if (events[i].events & EPOLLOUT) {
+            conn_flush(c);
+        }
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            conn_read(c, measuring);
+        }
+    }
+}
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return the p-th percentile (0 < p <= 100) of the sorted latencies, in
+ * microseconds.
+ */
+static double percentile(double p) {
+    if (nlatencies == 0) {
+        return 0;
+    }
+    size_t i = (size_t) (p / 100 * nlatencies);
+    if (i >= nlatencies) {
+        i = nlatencies - 1;
+    }
+    return latencies[i] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    char *host = "127.0.0.1";
+    int port = PORT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:u:r:d:m:h:p:")) != -1) {
+        switch (opt) {
+            case 'c':
+                nconns = strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                nusers = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                rate = strtod(optarg, NULL);
+                break;
+            case 'd':
+                duration = strtod(optarg, NULL);
+                break;
+            case 'm':
+                parse_mix(optarg);
+                break;
+            case 'h':
+                host = optarg;
+                break;
+            case 'p':
+                port = strtol(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (nconns < 1 || rate <= 0 || duration <= 0) {
+        usage();
+    }
+    if (nusers <= 0) {
+        nusers = nconns;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "host must be an IPv4 address\n");
+        exit(1);
+    }
+
+    // Each connection is an fd: allow as many as the hard limit permits.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    conns = calloc(nconns, sizeof(struct conn));
+    if (conns == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < nconns; i++) {
+        conns[i].id = i;
+        conn_open(&conns[i], &addr);
+    }
+
+    // Log everybody in before the clock starts.
+    int64_t deadline = now_ns() + (int64_t) LOGIN_TIMEOUT * 1000000000;
+    while (nready + nclosed < nconns && now_ns() < deadline) {
+        poll_events(100, 0);
+    }
+    if (nready == 0) {
+        fprintf(stderr, "no connection logged in\n");
+        exit(1);
+    }
+
+    // Open loop: command k is due at start + k / rate, whatever the replies.
+    double interval = 1e9 / rate;
+    int64_t start = now_ns();
+    int64_t end = start + (int64_t) (duration * 1e9);
+    long k = 0;
+    int next = 0;
+    while (1) {
+        int64_t now = now_ns();
+        if (now >= end) {
+            break;
+        }
+        while (start + (int64_t) (k * interval) <= now && nready > 0) {
+            while (conns[next].state != READY) {
+                next = (next + 1) % nconns;
+            }
+            send_command(&conns[next], start + (int64_t) (k * interval), k);
+            next = (next + 1) % nconns;
+            k++;
+        }
+        int64_t wait = start + (int64_t) (k * interval) - now_ns();
+        poll_events(wait > 0 ? (int) (wait / 1000000) : 0, 1);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // Give the replies still in flight a moment to arrive.
+    int64_t drain_end = now_ns() + 1000000000;
+    while (now_ns() < drain_end) {
+        poll_events(10, 1);
+    }
+
+    long outstanding = 0;
+    for (int i = 0; i < nconns; i++) {
+        outstanding += conns[i].state == CLOSED ? 0 : conns[i].due_count;
+    }
+
+    qsort(latencies, nlatencies, sizeof(int64_t), compare_int64);
+    printf("connections: %d (%d logged in, %d closed)\n", nconns, nready, nclosed);
+    printf("mix:");
+    for (int i = 0; i < NCOMMANDS; i++) {
+        printf(" %s=%d", command_names[i], mix[i]);
+    }
+    printf("\n");
+    printf("target rate: %.0f/s  sent: %.0f/s over %.1f s\n", rate, issued / elapsed, elapsed);
+    printf("answered: %zu of %ld  unanswered: %ld\n", nlatencies, issued, outstanding);
+    printf("latency (us): p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n",
+           percentile(50), percentile(90), percentile(99), percentile(99.9),
+           nlatencies ? latencies[nlatencies - 1] / 1000.0 : 0);
+    return 0;
+}
@@ -0,0 +1,784 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "friends.h"
+#include "persist.h"
+
+#define LOG_MAGIC 0x474f4c46u       // "FLOG"
+#define SNAP_MAGIC 0x504e5346u      // "FSNP"
+#define FORMAT_VERSION 1            // of logs
+#define SNAP_VERSION 4
+#define RECORD_HEADER 8             // u32 body length, u32 checksum
+#define SNAP_BUFSIZE (1 << 20)
+#define MAX_CONTENTS (1 << 20)      // Longest post a file may claim to hold
+#define MAX_LOGS 1024               // Log files looked at on startup
+#define LOG_PREFIX "friends.log."
+
+enum record_type {REC_USER = 1, REC_FRIENDS, REC_POST};
+
+struct file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t gen;       // log generation
+};
+
+/*
+ * A snapshot is laid out so it can be mapped and used in place:
+ *
+ *   snap_header
+ *   snap_user[nusers]          in list order
+ *   uint32_t[nfriends]         friend ids, each user's in one ascending run
+ *   (padding to 8 bytes)
+ *   snap_post[nposts]          each user's in one run, oldest first
+ *   char[blob_bytes]           each post's date text then contents, each
+ *                              ending in '\0'
+ *
+ * A user's id is its index in the list.  Dates are kept as the text
+ * they were shown as when the post was made, like Post.date_text.
+ *
+ * Loading builds the users and posts as flat arrays pointing into the
+ * mapping, so post text is never copied or formatted, and is only read
+ * from disk when a profile shows it.
+ */
+struct snap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t gen;       // generation of the log that follows
+    uint64_t nusers;
+    uint64_t nfriends;  // friend entries: two per friendship
+    uint64_t nposts;
+    uint64_t blob_bytes;
+};
+
+struct snap_user {
+    char name[MAX_NAME];
+    char profile_pic[MAX_NAME];
+    uint64_t first_friend;
+    uint64_t first_post;
+    uint32_t nfriends;
+    uint32_t nposts;
+};
+
+struct snap_post {
+    int64_t date;
+    uint64_t date_text; // offset in the blob
+    uint64_t contents;  // offset in the blob
+    uint32_t author;    // user id
+    uint32_t pad;
+};
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+
+static struct {
+    pthread_mutex_t append_lock;    // guards buf, spare, appended, durable, size
+    pthread_mutex_t sync_lock;      // held while writing and syncing
+    int fd;                         // -1 until persist_open()
+    int do_sync;
+    char snap_path[4096];
+    char dir[4096];
+    uint64_t gen;
+    char *buf;                      // records not yet written
+    size_t len;
+    size_t cap;
+    char *spare;                    // buffer being written by wal_commit()
+    size_t spare_cap;
+    uint64_t appended;              // records appended so far
+    uint64_t durable;               // records written and synced
+    uint64_t size;                  // file size plus len
+} wal = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, -1};
+
+/*
+ * 32-bit FNV-1a checksum of len bytes.
+ */
+static uint32_t checksum(const char *data, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Write all len bytes of buf to fd.  Return 0 on success, -1 on error.
+ */
+static int write_full(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Make a rename in wal.dir durable.
+ */
+static void sync_dir(void) {
+    int fd = open(wal.dir, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Append len bytes to the unwritten records.  Caller holds append_lock.
+ */
+static void buf_put(const void *src, size_t len) {
+    if (wal.len + len > wal.cap) {
+        wal.cap = (wal.len + len) * 2;
+        wal.buf = realloc(wal.buf, wal.cap);
+        if (wal.buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(wal.buf + wal.len, src, len);
+    wal.len += len;
+}
+
+static void buf_put_str(const char *s) {
+    uint32_t len = strlen(s);
+    buf_put(&len, sizeof(len));
+    buf_put(s, len);
+}
+
+/*
+ * Start a record of the given type and return where it begins.
+ */
+static size_t begin_record(uint8_t type) {
+    size_t start = wal.len;
+    char header[RECORD_HEADER] = {0};
+    buf_put(header, RECORD_HEADER);
+    buf_put(&type, 1);
+    return start;
+}
+
+/*
+ * Fill in the header of the record that begins at start.
+ */
+static void end_record(size_t start) {
+    uint32_t len = wal.len - start - RECORD_HEADER;
+    uint32_t sum = checksum(wal.buf + start + RECORD_HEADER, len);
+    memcpy(wal.buf + start, &len, sizeof(len));
+    memcpy(wal.buf + start + sizeof(len), &sum, sizeof(sum));
+    wal.size += wal.len - start;
+    wal.appended++;
+}
+
+void wal_user(const char *name) {
+    if (wal.fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&wal.append_lock);
+    size_t start = begin_record(REC_USER);
+    buf_put_str(name);
+    end_record(start);
+    pthread_mutex_unlock(&wal.append_lock);
+}
+
+void wal_friends(const char *name1, const char *name2) {
+    if (wal.fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&wal.append_lock);
+    size_t start = begin_record(REC_FRIENDS);
+    buf_put_str(name1);
+    buf_put_str(name2);
+    end_record(start);
+    pthread_mutex_unlock(&wal.append_lock);
+}
+
+void wal_post(const char *author, const char *target, time_t date, const char *contents) {
+    if (wal.fd == -1) {
+        return;
+    }
+    int64_t when = date;
+    pthread_mutex_lock(&wal.append_lock);
+    size_t start = begin_record(REC_POST);
+    buf_put_str(author);
+    buf_put_str(target);
+    buf_put(&when, sizeof(when));
+    buf_put_str(contents);
+    end_record(start);
+    pthread_mutex_unlock(&wal.append_lock);
+}
+
+void wal_commit(void) {
+    if (wal.fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&wal.append_lock);
+    int behind = wal.durable < wal.appended;
+    pthread_mutex_unlock(&wal.append_lock);
+    if (!behind) {
+        return;
+    }
+
+    // Whoever gets sync_lock first writes everything appended so far;
+    // the others then find their records already durable.
+    pthread_mutex_lock(&wal.sync_lock);
+    pthread_mutex_lock(&wal.append_lock);
+    char *data = wal.buf;
+    size_t data_cap = wal.cap;
+    size_t len = wal.len;
+    uint64_t upto = wal.appended;
+    wal.buf = wal.spare;    // appends carry on into the other buffer
+    wal.cap = wal.spare_cap;
+    wal.len = 0;
+    pthread_mutex_unlock(&wal.append_lock);
+
+    if (len > 0) {
+        if (write_full(wal.fd, data, len) == -1) {
+            perror("write to log");
+            exit(1);
+        }
+        if (wal.do_sync && fdatasync(wal.fd) == -1) {
+            perror("fdatasync");
+            exit(1);
+        }
+    }
+
+    pthread_mutex_lock(&wal.append_lock);
+    wal.spare = data;
+    wal.spare_cap = data_cap;
+    wal.durable = upto;
+    pthread_mutex_unlock(&wal.append_lock);
+    pthread_mutex_unlock(&wal.sync_lock);
+}
+
+uint64_t wal_size(void) {
+    pthread_mutex_lock(&wal.append_lock);
+    uint64_t size = wal.size;
+    pthread_mutex_unlock(&wal.append_lock);
+    return size;
+}
+
+/*
+ * Write the path of the log of generation gen into path.
+ */
+static void log_path(uint64_t gen, char *path, size_t size) {
+    snprintf(path, size, "%s/" LOG_PREFIX "%" PRIu64, wal.dir, gen);
+}
+
+/*
+ * Create an empty log of generation gen and make it the one appended to.
+ * Return 0 on success, -1 on error.
+ */
+static int start_log(uint64_t gen) {
+    char path[4200];
+    struct file_header header = {LOG_MAGIC, FORMAT_VERSION, gen};
+
+    log_path(gen, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    if (write_full(fd, (const char *) &header, sizeof(header)) == -1 || fsync(fd) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    sync_dir();
+
+    if (wal.fd != -1) {
+        close(wal.fd);
+    }
+    wal.fd = fd;
+    wal.gen = gen;
+    wal.size = sizeof(header);
+    return 0;
+}
+
+/*
+ * A bounds-checked cursor over a file's bytes.
+ */
+struct reader {
+    const char *data;
+    size_t len;
+    size_t pos;
+};
+
+static int read_bytes(struct reader *r, void *dst, size_t len) {
+    if (r->len - r->pos < len) {
+        return -1;
+    }
+    memcpy(dst, r->data + r->pos, len);
+    r->pos += len;
+    return 0;
+}
+
+/*
+ * Point *s at a length-prefixed string in place and set *len to its
+ * length.  Return -1 if it does not fit.
+ */
+static int read_span(struct reader *r, const char **s, uint32_t *len) {
+    if (read_bytes(r, len, sizeof(*len)) == -1 || *len > MAX_CONTENTS ||
+        r->len - r->pos < *len) {
+        return -1;
+    }
+    *s = r->data + r->pos;
+    r->pos += *len;
+    return 0;
+}
+
+/*
+ * Read a string into a fixed buffer of size MAX_NAME.
+ */
+static int read_name(struct reader *r, char *name) {
+    uint32_t len;
+    if (read_bytes(r, &len, sizeof(len)) == -1 || len >= MAX_NAME) {
+        return -1;
+    }
+    name[len] = '\0';
+    return read_bytes(r, name, len);
+}
+
+/*
+ * Map path into memory.  Return 0 and fill in r, or -1 if it does not
+ * exist (errno is ENOENT) or cannot be read.
+ */
+static int map_file(const char *path, struct reader *r) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    r->len = st.st_size;
+    r->pos = 0;
+    r->data = NULL;
+    if (r->len > 0) {
+        r->data = mmap(NULL, r->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (r->data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static void unmap_file(struct reader *r) {
+    if (r->len > 0) {
+        munmap((void *) r->data, r->len);
+    }
+}
+
+/*
+ * Load the snapshot mapped by r into *user_list_ptr, which must be empty.
+ * Posts point into the mapping, so it must stay mapped.  Return 0 on
+ * success, -1 if the snapshot is damaged.  *gen is set to the generation
+ * of the log that follows it.
+ */
+static int load_snapshot(const struct reader *r, User **user_list_ptr, uint64_t *gen,
+                         long *nfriendships, long *nposts) {
+    const struct snap_header *header = (const void *) r->data;
+    if (r->len < sizeof(*header) || header->magic != SNAP_MAGIC ||
+        header->version != SNAP_VERSION) {
+        return -1;
+    }
+    *gen = header->gen;
+
+    // Check that every section fits before looking inside any.
+    uint64_t nusers = header->nusers, nfriends = header->nfriends;
+    uint64_t nposts_total = header->nposts, blob_bytes = header->blob_bytes;
+    if (nusers > r->len / sizeof(struct snap_user) || nfriends > r->len / sizeof(uint32_t) ||
+        nposts_total > r->len / sizeof(struct snap_post) || blob_bytes > r->len) {
+        return -1;
+    }
+    uint64_t friends_off = sizeof(*header) + nusers * sizeof(struct snap_user);
+    uint64_t posts_off = ALIGN8(friends_off + nfriends * sizeof(uint32_t));
+    uint64_t blob_off = posts_off + nposts_total * sizeof(struct snap_post);
+    if (blob_off + blob_bytes != r->len || (blob_bytes > 0 && r->data[r->len - 1] != '\0') ||
+        (nposts_total > 0 && blob_bytes == 0)) {
+        return -1;
+    }
+    const struct snap_user *saved_users = (const void *) (r->data + sizeof(*header));
+    const uint32_t *saved_friends = (const void *) (r->data + friends_off);
+    const struct snap_post *saved_posts = (const void *) (r->data + posts_off);
+    char *blob = (char *) r->data + blob_off;
+
+    if (nusers == 0) {
+        return 0;
+    }
+    User *users = calloc(nusers, sizeof(User));
+    User **friends = malloc(sizeof(User *) * (nfriends ? nfriends : 1));
+    Post *posts = malloc(sizeof(Post) * (nposts_total ? nposts_total : 1));
+    Post **post_index = malloc(sizeof(Post *) * (nposts_total ? nposts_total : 1));
+    if (users == NULL || friends == NULL || posts == NULL || post_index == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (uint64_t i = 0; i < nusers; i++) {
+        const struct snap_user *saved = &saved_users[i];
+        User *user = &users[i];
+        if (memchr(saved->name, '\0', MAX_NAME) == NULL ||
+            memchr(saved->profile_pic, '\0', MAX_NAME) == NULL ||
+            saved->first_friend > nfriends ||
+            saved->nfriends > nfriends - saved->first_friend ||
+            saved->first_post > nposts_total || saved->nposts > nposts_total - saved->first_post) {
+            goto damaged;
+        }
+        memcpy(user->name, saved->name, MAX_NAME);
+        memcpy(user->profile_pic, saved->profile_pic, MAX_NAME);
+        user->id = i;
+        user->next = (i + 1 < nusers) ? &users[i + 1] : NULL;
+
+        // Friends share one array; make_friends copies a user's out when it grows.
+        user->friends = &friends[saved->first_friend];
+        user->nfriends = saved->nfriends;
+        for (uint32_t j = 0; j < saved->nfriends; j++) {
+            uint32_t id = saved_friends[saved->first_friend + j];
+            // Compare raw ids: users after i have no id set yet.
+            if (id >= nusers || id == i ||
+                (j > 0 && id <= saved_friends[saved->first_friend + j - 1])) {
+                goto damaged;   // out of range, the user itself, or out of order
+            }
+            user->friends[j] = &users[id];
+        }
+
+        // The index shares one array like friends.
+        user->posts = &post_index[saved->first_post];
+        user->nposts = saved->nposts;
+        for (uint32_t j = 0; j < saved->nposts; j++) {
+            uint64_t k = saved->first_post + j;
+            const struct snap_post *saved_post = &saved_posts[k];
+            if (saved_post->author >= nusers || saved_post->contents >= blob_bytes ||
+                saved_post->date_text >= blob_bytes) {
+                goto damaged;
+            }
+            // The blob ends in '\0', so no string can run off the end.
+            posts[k].author = &users[saved_post->author];
+            posts[k].target = user;
+            posts[k].date = saved_post->date;
+            posts[k].date_text = blob + saved_post->date_text;
+            posts[k].contents = blob + saved_post->contents;
+            user->posts[j] = &posts[k];
+        }
+    }
+
+    // Index the names now rather than on the first lookup.
+    *user_list_ptr = users;
+    find_user(users[0].name, users);
+    index_authors(users);
+    index_friend_bits(users);
+    *nfriendships = nfriends / 2;
+    *nposts = nposts_total;
+    return 0;
+
+damaged:
+    free(users);
+    free(friends);
+    free(posts);
+    free(post_index);
+    return -1;
+}
+
+/*
+ * Apply the log's records to *user_list_ptr.  Return the offset just past
+ * the last complete record.
+ */
+static size_t replay_log(struct reader *r, User **user_list_ptr, long *nrecords) {
+    char name1[MAX_NAME], name2[MAX_NAME];
+
+    while (r->pos < r->len) {
+        size_t record_start = r->pos;
+        uint32_t len, sum;
+        uint8_t type;
+        if (read_bytes(r, &len, sizeof(len)) == -1 || read_bytes(r, &sum, sizeof(sum)) == -1 ||
+            r->len - r->pos < len || checksum(r->data + r->pos, len) != sum) {
+            return record_start;
+        }
+
+        struct reader body = {r->data + r->pos, len, 0};
+        r->pos += len;
+        if (read_bytes(&body, &type, 1) == -1) {
+            return record_start;
+        }
+
+        if (type == REC_USER && read_name(&body, name1) == 0) {
+            create_user(name1, user_list_ptr);
+        } else if (type == REC_FRIENDS && read_name(&body, name1) == 0 &&
+                   read_name(&body, name2) == 0) {
+            make_friends(name1, name2, *user_list_ptr);
+        } else if (type == REC_POST && read_name(&body, name1) == 0 &&
+                   read_name(&body, name2) == 0) {
+            int64_t date;
+            const char *contents;
+            uint32_t len;
+            if (read_bytes(&body, &date, sizeof(date)) == -1 ||
+                read_span(&body, &contents, &len) == -1) {
+                return record_start;
+            }
+            make_post_at(find_user(name1, *user_list_ptr), find_user(name2, *user_list_ptr),
+                         contents, len, date);
+        } else {
+            return record_start;
+        }
+        (*nrecords)++;
+    }
+    return r->pos;
+}
+
+/*
+ * Return the number of milliseconds since start.
+ */
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int compare_gen(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Find the logs in wal.dir.  Fill gens with their generations, oldest
+ * first, and return how many there are.
+ */
+static int list_logs(uint64_t *gens) {
+    int count = 0;
+    DIR *d = opendir(wal.dir);
+    if (d == NULL) {
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL && count < MAX_LOGS) {
+        char *end;
+        if (strncmp(entry->d_name, LOG_PREFIX, strlen(LOG_PREFIX)) != 0) {
+            continue;
+        }
+        uint64_t gen = strtoull(entry->d_name + strlen(LOG_PREFIX), &end, 10);
+        if (*end == '\0' && end != entry->d_name + strlen(LOG_PREFIX)) {
+            gens[count++] = gen;
+        }
+    }
+    closedir(d);
+    qsort(gens, count, sizeof(uint64_t), compare_gen);
+    return count;
+}
+
+void wal_drop_before(uint64_t gen) {
+    uint64_t gens[MAX_LOGS];
+    char path[4200];
+    int count = list_logs(gens);
+    for (int i = 0; i < count && gens[i] < gen; i++) {
+        log_path(gens[i], path, sizeof(path));
+        if (unlink(path) == -1) {
+            perror(path);
+        }
+    }
+    sync_dir();
+}
+
+int persist_open(const char *dir, User **user_list_ptr, int do_sync) {
+    struct reader r;
+    struct timespec start;
+    uint64_t snap_gen = 0;
+    long nfriendships = 0, nposts = 0, nrecords = 0;
+    uint64_t gens[MAX_LOGS];
+    char path[4200];
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    snprintf(wal.dir, sizeof(wal.dir), "%s", dir);
+    snprintf(wal.snap_path, sizeof(wal.snap_path), "%s/friends.snap", dir);
+    wal.do_sync = do_sync;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (map_file(wal.snap_path, &r) == 0) {
+        // Stays mapped: loaded posts point into it.
+        int result = load_snapshot(&r, user_list_ptr, &snap_gen, &nfriendships, &nposts);
+        if (result == -1) {
+            unmap_file(&r);
+            fprintf(stderr, "%s is damaged\n", wal.snap_path);
+            return -1;
+        }
+        fprintf(stderr, "Loaded snapshot: %ld friendships, %ld posts in %.1f ms\n",
+                nfriendships, nposts, elapsed_ms(&start));
+    } else if (errno != ENOENT) {
+        perror(wal.snap_path);
+        return -1;
+    }
+
+    // Replay every log the snapshot does not already hold, oldest first.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int count = list_logs(gens);
+    uint64_t last_gen = 0;
+    size_t last_size = 0;
+    for (int i = 0; i < count; i++) {
+        struct file_header header;
+        if (gens[i] < snap_gen) {
+            continue;
+        }
+        log_path(gens[i], path, sizeof(path));
+        if (map_file(path, &r) == -1) {
+            perror(path);
+            return -1;
+        }
+        if (read_bytes(&r, &header, sizeof(header)) == -1 || header.magic != LOG_MAGIC ||
+            header.version != FORMAT_VERSION || header.gen != gens[i]) {
+            unmap_file(&r);     // created but never written: nothing to replay
+            continue;
+        }
+        size_t end = replay_log(&r, user_list_ptr, &nrecords);
+        if (end < r.len) {
+            fprintf(stderr, "Dropping %zu bytes of incomplete records from %s\n", r.len - end, path);
+            if (truncate(path, end) == -1) {
+                perror(path);
+            }
+        }
+        unmap_file(&r);
+        last_gen = gens[i];
+        last_size = end;
+    }
+    fprintf(stderr, "Replayed %ld log records in %.1f ms\n", nrecords, elapsed_ms(&start));
+    wal_drop_before(snap_gen);     // left behind by a crash after a snapshot
+
+    // Carry on appending to the newest log.
+    if (last_gen == 0) {
+        return start_log(snap_gen > 0 ? snap_gen : 1);
+    }
+    log_path(last_gen, path, sizeof(path));
+    if ((wal.fd = open(path, O_WRONLY | O_APPEND)) == -1) {
+        perror(path);
+        return -1;
+    }
+    wal.gen = last_gen;
+    wal.size = last_size;
+    return 0;
+}
+
+uint64_t wal_rotate(void) {
+    pthread_mutex_lock(&wal.sync_lock);
+    pthread_mutex_lock(&wal.append_lock);
+    if (wal.len > 0) {
+        if (write_full(wal.fd, wal.buf, wal.len) == -1 ||
+            (wal.do_sync && fdatasync(wal.fd) == -1)) {
+            perror("write to log");
+            exit(1);
+        }
+        wal.len = 0;
+        wal.durable = wal.appended;
+    }
+    if (start_log(wal.gen + 1) == -1) {
+        exit(1);
+    }
+    uint64_t gen = wal.gen;
+    pthread_mutex_unlock(&wal.append_lock);
+    pthread_mutex_unlock(&wal.sync_lock);
+    return gen;
+}
+
+int snapshot_write(const User *head, uint64_t gen, long *bytes) {
+    char tmp_path[4200];
+    uint32_t nusers = 0;
+
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        nusers++;
+    }
+
+    // Size every section first: the header and users give offsets into them.
+    struct snap_header header = {SNAP_MAGIC, SNAP_VERSION, gen, nusers, 0, 0, 0};
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        header.nfriends += curr->nfriends;
+        header.nposts += curr->nposts;
+        for (uint32_t j = 0; j < curr->nposts; j++) {
+            header.blob_bytes += strlen(curr->posts[j]->date_text) + 1 +
+                                 strlen(curr->posts[j]->contents) + 1;
+        }
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", wal.snap_path);
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    setvbuf(f, NULL, _IOFBF, SNAP_BUFSIZE);
+    fwrite(&header, sizeof(header), 1, f);
+
+    uint64_t first_friend = 0, first_post = 0;
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        struct snap_user saved;
+        memset(&saved, 0, sizeof(saved));
+        strncpy(saved.name, curr->name, MAX_NAME - 1);
+        strncpy(saved.profile_pic, curr->profile_pic, MAX_NAME - 1);
+        saved.first_friend = first_friend;
+        saved.first_post = first_post;
+        saved.nfriends = curr->nfriends;
+        saved.nposts = curr->nposts;
+        first_friend += saved.nfriends;
+        first_post += saved.nposts;
+        fwrite(&saved, sizeof(saved), 1, f);
+    }
+
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        for (uint32_t j = 0; j < curr->nfriends; j++) {
+            fwrite(&curr->friends[j]->id, sizeof(uint32_t), 1, f);
+        }
+    }
+    static const char zeros[8];
+    uint64_t friends_end = sizeof(header) + nusers * sizeof(struct snap_user) +
+                           header.nfriends * sizeof(uint32_t);
+    fwrite(zeros, 1, ALIGN8(friends_end) - friends_end, f);
+
+    uint64_t blob_pos = 0;
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        for (uint32_t j = 0; j < curr->nposts; j++) {
+            const Post *post = curr->posts[j];
+            struct snap_post saved = {post->date, blob_pos, 0, post->author->id, 0};
+            blob_pos += strlen(post->date_text) + 1;
+            saved.contents = blob_pos;
+            blob_pos += strlen(post->contents) + 1;
+            fwrite(&saved, sizeof(saved), 1, f);
+        }
+    }
+
+    for (const User *curr = head; curr != NULL; curr = curr->next) {
+        for (uint32_t j = 0; j < curr->nposts; j++) {
+            const Post *post = curr->posts[j];
+            fwrite(post->date_text, 1, strlen(post->date_text) + 1, f);
+            fwrite(post->contents, 1, strlen(post->contents) + 1, f);
+        }
+    }
+
+    if (fflush(f) == EOF || ferror(f) || fsync(fileno(f)) == -1) {
+        fclose(f);
+        unlink(tmp_path);
+        return -1;
+    }
+    *bytes = ftell(f);
+    fclose(f);
+    if (rename(tmp_path, wal.snap_path) == -1) {
+        return -1;
+    }
+    sync_dir();
+    return 0;
+}
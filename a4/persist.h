@@ -0,0 +1,79 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+struct user;
+
+/*
+ * Durable storage for the user graph.
+ *
+ * Every change is appended to a write-ahead log.  Records collect in
+ * memory and are written with one write() and fdatasync() per
+ * wal_commit() call, so all the changes made during one pass of an event
+ * loop cost a single sync.  Now and then the whole graph is written to a
+ * snapshot (friends.snap).
+ *
+ * Logs are numbered by generation (friends.log.1, friends.log.2, ...).
+ * Taking a snapshot starts the next log with wal_rotate(), writes the
+ * graph as it was at that moment with snapshot_write() -- possibly in
+ * another process -- and only then removes the older logs with
+ * wal_drop_before().  The snapshot records the generation of the log
+ * started with it, and startup replays that log and any newer ones, so a
+ * crash at any point loses nothing and replays nothing twice.
+ *
+ * Files are in native byte order.
+ */
+
+/*
+ * Load dir/friends.snap and replay the logs it does not cover into
+ * *user_list_ptr, then open the newest log for appending.  A torn record
+ * at the end of a log (from a crash mid-write) is cut off.  Creates dir
+ * if needed.  If do_sync is 0, commits skip fdatasync().
+ * Return 0 on success, -1 if the files could not be read or opened.
+ */
+int persist_open(const char *dir, struct user **user_list_ptr, int do_sync);
+
+/*
+ * Append one change to the log.  Callers must apply changes to the graph
+ * in the same order they log them (i.e. hold the graph's write lock).
+ * These do nothing until persist_open() has been called.
+ */
+void wal_user(const char *name);
+void wal_friends(const char *name1, const char *name2);
+void wal_post(const char *author, const char *target, time_t date, const char *contents);
+
+/*
+ * Make every change logged so far durable.  Threads calling this at the
+ * same time share one write and sync.
+ */
+void wal_commit(void);
+
+/*
+ * Return the size of the log in bytes, including records not yet written.
+ */
+uint64_t wal_size(void);
+
+/*
+ * Make every change logged so far durable and start a new log.  The graph
+ * must not change between this and taking the snapshot it is for.
+ * Return the generation of the new log.
+ */
+uint64_t wal_rotate(void);
+
+/*
+ * Write a snapshot of the list starting at head, to be followed by the
+ * log of generation gen, and store its size in *bytes.  Prints nothing and
+ * touches no lock of this module, so a child of fork() may call it.
+ * Return 0 on success, -1 on error (the old snapshot remains).
+ */
+int snapshot_write(const struct user *head, uint64_t gen, long *bytes);
+
+/*
+ * Remove the logs older than generation gen, once a snapshot covers them.
+ */
+void wal_drop_before(uint64_t gen);
+
+#endif
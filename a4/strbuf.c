@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "strbuf.h"
+
+void sb_reserve(StrBuf *sb, size_t extra) {
+    if (sb->len + extra < sb->cap) {
+        return;
+    }
+    size_t new_cap = sb->cap ? sb->cap : 256;
+    while (sb->len + extra >= new_cap) {
+        new_cap *= 2;
+    }
+    char *data = realloc(sb->data, new_cap);
+    if (data == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    sb->data = data;
+    sb->cap = new_cap;
+}
+
+void sb_append(StrBuf *sb, const char *s, size_t len) {
+    sb_reserve(sb, len);
+    memcpy(sb->data + sb->len, s, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_puts(StrBuf *sb, const char *s) {
+    sb_append(sb, s, strlen(s));
+}
+
+void sb_printf(StrBuf *sb, const char *fmt, ...) {
+    va_list ap;
+
+    // Most output fits in the space already there: format straight into it.
+    sb_reserve(sb, 0);
+    va_start(ap, fmt);
+    int len = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        sb->data[sb->len] = '\0';
+        return;
+    }
+    if ((size_t) len >= sb->cap - sb->len) {
+        sb_reserve(sb, len);
+        va_start(ap, fmt);
+        vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+        va_end(ap);
+    }
+    sb->len += len;
+}
+
+void sb_clear(StrBuf *sb) {
+    sb->len = 0;
+    if (sb->data != NULL) {
+        sb->data[0] = '\0';
+    }
+}
+
+char *sb_detach(StrBuf *sb) {
+    sb_reserve(sb, 0);
+    char *s = sb->data;
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+    return s;
+}
+
+void sb_free(StrBuf *sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stddef.h>
+
+/*
+ * A growable string that tracks its length, so appending costs time in
+ * proportion to what is appended rather than to what is already there.
+ * data is always '\0'-terminated once anything has been appended.
+ * Clearing keeps the memory, so one StrBuf can be reused for many replies.
+ */
+typedef struct strbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+#define STRBUF_INIT {NULL, 0, 0}
+
+/*
+ * Make room for at least extra more bytes (plus the terminator).
+ */
+void sb_reserve(StrBuf *sb, size_t extra);
+
+void sb_append(StrBuf *sb, const char *s, size_t len);
+void sb_puts(StrBuf *sb, const char *s);
+void sb_printf(StrBuf *sb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Empty sb but keep its memory.
+ */
+void sb_clear(StrBuf *sb);
+
+/*
+ * Return sb's contents as a malloc'd string that the caller must free,
+ * and leave sb empty.
+ */
+char *sb_detach(StrBuf *sb);
+
+/*
+ * Free sb's memory and leave it empty.
+ */
+void sb_free(StrBuf *sb);
+
+#endif